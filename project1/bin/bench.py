@@ -0,0 +1,303 @@
+#!/usr/bin/env python3
+'''
+    File name: bench.py
+    Description: workload generator and throughput / latency benchmark of project1
+    Usage:
+        python3 bin/bench.py [options] [-- ./run --threads=4]
+        python3 bin/bench.py --patterns=100000 --mix=80:10:10 --targets=run,ref
+        python3 bin/bench.py --generate=test/data/bench   # only write bench.init, bench.work, bench.result
+        python3 bin/bench.py --engines=automaton,memmem,rabin-karp,auto --targets=run
+    Output:
+        one JSON object on stdout, per target:
+        - build_ms: time until "R"
+        - throughput: commands/sec, queries/sec and query MB/sec when whole workload is streamed
+        - latency: per command round trip (us) of closed loop, p50/p99/p999
+            "query" is a Q right after Q, "update" is a Q right after A or D
+            (A, D print nothing, their cost is paid by next Q which must see them)
+        - digest: hash of output, equal digests mean targets agree
+        - engines (--engines): run is a target per matcher engine (--engine=...), to compare them
+        - counters (--counters): cache misses per query byte from `perf stat`,
+            run of init only is subtracted so build is not counted
+'''
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ALPHABETS = {
+    'az': 'abcdefghijklmnopqrstuvwxyz',
+    'dna': 'acgt',
+    'ascii': ''.join(chr(c) for c in range(33, 127)),
+    # every byte but newline (text is latin-1, one char per byte), up to 255 byte classes
+    'bytes': ''.join(chr(c) for c in range(256) if c != 10),
+}
+# initial patterns are whitespace separated tokens, they take no separator byte
+SEPARATORS = ' \t\r\n'
+
+
+def generate(args):
+    '''
+    make (init, work) text of workload
+    - patterns: length is uniform in [min_len, max_len], or geometric (short ones common)
+    - queries: uniform random text, `hit` of them embed some live pattern,
+        with `distinct` only that many are made and later ones repeat them (cache hits, results across versions)
+    - mix: ratio of Q, A, D; D removes a live pattern most of the time
+    - initial patterns take no SEPARATORS, A and Q lines take whole alphabet
+    '''
+    rand = random.Random(args.seed)
+    alphabet = ALPHABETS.get(args.alphabet, args.alphabet)
+
+    def length():
+        if args.length_dist == 'geometric':
+            size = args.min_len
+            while size < args.max_len and rand.random() > 1.0 / (1 + (args.max_len - args.min_len) / 4.0):
+                size += 1
+            return size
+        return rand.randint(args.min_len, args.max_len)
+
+    def word(size, letters=alphabet):
+        return ''.join(rand.choice(letters) for _ in range(size))
+
+    tokens = ''.join(ch for ch in alphabet if ch not in SEPARATORS)
+    # dict keeps first occurrence order, a set would order by string hash, which changes per process
+    patterns = list(dict.fromkeys(word(length(), tokens) for _ in range(args.patterns)))
+    live = list(patterns)
+    init = '{}\n{}\n'.format(len(patterns), '\n'.join(patterns))
+
+    q, a, d = (float(x) for x in args.mix.split(':'))
+    total = q + a + d
+    lines = []
+    queries = []
+    for _ in range(args.commands):
+        r = rand.random() * total
+        if r < q or not live:
+            if args.distinct and len(queries) >= args.distinct:
+                lines.append('Q ' + rand.choice(queries))
+                continue
+            text = word(rand.randint(max(1, args.query_len // 2), args.query_len))
+            if live and rand.random() < args.hit:
+                at = rand.randint(0, len(text))
+                text = text[:at] + rand.choice(live) + text[at:]
+            queries.append(text)
+            lines.append('Q ' + text)
+        elif r < q + a:
+            pattern = word(length())
+            live.append(pattern)
+            lines.append('A ' + pattern)
+        else:
+            index = rand.randrange(len(live))
+            live[index], live[-1] = live[-1], live[index]
+            lines.append('D ' + live.pop())
+    return init, '\n'.join(lines) + '\n'
+
+
+def expected(init, work):
+    '''
+    output of workload by a naive matcher, independent of run and ref (result file of marker)
+    - every live pattern found in query once, in order of first start then length, -1 if none
+    - duplicate A, D of a missing pattern change nothing, as in run
+    '''
+    lines = init.split('\n')
+    live = set(pattern for pattern in lines[1:1 + int(lines[0])] if pattern)
+    out = []
+    for line in work.split('\n'):
+        if not line:
+            continue
+        cmd, text = line[0], line[2:]
+        if cmd == 'A' and text:
+            live.add(text)
+        elif cmd == 'D':
+            live.discard(text)
+        elif cmd == 'Q':
+            lengths = sorted(set(len(pattern) for pattern in live))
+            seen = set()
+            hits = []
+            for start in range(len(text)):
+                for size in lengths:
+                    if start + size > len(text):
+                        break
+                    pattern = text[start:start + size]
+                    if pattern in live and pattern not in seen:
+                        seen.add(pattern)
+                        hits.append(pattern)
+            out.append('|'.join(hits) if hits else '-1')
+    return '\n'.join(out) + '\n'
+
+
+def percentiles(samples):
+    if not samples:
+        return None
+    samples = sorted(samples)
+
+    def at(p):
+        return round(samples[min(len(samples) - 1, int(p * len(samples)))] * 1e6, 1)
+    return {'count': len(samples), 'p50': at(0.5), 'p99': at(0.99), 'p999': at(0.999),
+            'max': round(samples[-1] * 1e6, 1)}
+
+
+def start(command, init):
+    begin = time.perf_counter()
+    process = subprocess.Popen(command, stdin=subprocess.PIPE, stdout=subprocess.PIPE, bufsize=0)
+    process.stdin.write(init.encode('latin-1'))
+    process.stdin.flush()
+    if process.stdout.readline().strip() != b'R':
+        raise Exception('{} did not answer R'.format(command))
+    return process, time.perf_counter() - begin
+
+
+def throughput(command, init, work, commands, queries, query_bytes):
+    '''stream whole workload, writer thread keeps pipe full'''
+    process, build = start(command, init)
+
+    def feed():
+        process.stdin.write(work.encode('latin-1'))
+        process.stdin.close()
+
+    begin = time.perf_counter()
+    writer = threading.Thread(target=feed)
+    writer.start()
+    output = process.stdout.read()
+    elapsed = time.perf_counter() - begin
+    writer.join()
+    process.wait()
+    return {
+        'build_ms': round(build * 1e3, 2),
+        'elapsed_ms': round(elapsed * 1e3, 2),
+        'commands_per_sec': round(commands / elapsed, 1),
+        'queries_per_sec': round(queries / elapsed, 1),
+        'query_mb_per_sec': round(query_bytes / elapsed / 1e6, 2),
+        'digest': hashlib.sha1(output).hexdigest(),
+    }
+
+
+def latency(command, init, work):
+    '''closed loop, next command is sent after answer of Q'''
+    process, _ = start(command, init)
+    query, update = [], []
+    pending = False
+    for line in work.split('\n')[:-1]:
+        data = (line + '\n').encode('latin-1')
+        begin = time.perf_counter()
+        process.stdin.write(data)
+        process.stdin.flush()
+        if line[0] != 'Q':
+            pending = True
+            continue
+        process.stdout.readline()
+        (update if pending else query).append(time.perf_counter() - begin)
+        pending = False
+    process.stdin.close()
+    process.wait()
+    return {'query': percentiles(query), 'update': percentiles(update)}
+
+
+COUNTERS = 'L1-dcache-load-misses,LLC-load-misses'
+
+
+def counted(command, stdin):
+    '''run command on stdin under perf stat, return {event: count}'''
+    with tempfile.NamedTemporaryFile(mode='r', suffix='.perf') as out:
+        subprocess.run(['perf', 'stat', '-x,', '-e', COUNTERS, '-o', out.name, '--'] + command,
+                       input=stdin.encode('latin-1'), stdout=subprocess.DEVNULL, check=True)
+        result = {}
+        for line in out.read().splitlines():
+            fields = line.split(',')
+            if len(fields) > 2 and not line.startswith('#'):
+                try:
+                    result[fields[2]] = int(fields[0])
+                except ValueError:
+                    result[fields[2]] = None
+        return result
+
+
+def counters(command, init, work, query_bytes):
+    '''cache misses per query byte, misses of build (init only) are subtracted'''
+    full = counted(command, init + work)
+    build = counted(command, init)
+    result = {}
+    for event, count in full.items():
+        if count is None or build.get(event) is None:
+            result[event] = None
+        else:
+            result[event + '_per_byte'] = round((count - build[event]) / max(query_bytes, 1), 4)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description='project1 workload generator and benchmark')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--patterns', type=int, default=10000, help='initial patterns')
+    parser.add_argument('--min-len', type=int, default=4)
+    parser.add_argument('--max-len', type=int, default=16)
+    parser.add_argument('--length-dist', choices=['uniform', 'geometric'], default='uniform')
+    parser.add_argument('--alphabet', default='az', help='az, dna, ascii, bytes (all but newline) or literal characters')
+    parser.add_argument('--query-len', type=int, default=1000, help='longest query, shortest is half of it')
+    parser.add_argument('--hit', type=float, default=0.5, help='ratio of queries embedding a live pattern')
+    parser.add_argument('--distinct', type=int, default=0, help='distinct queries, later ones repeat them, 0 for all distinct')
+    parser.add_argument('--commands', type=int, default=10000)
+    parser.add_argument('--mix', default='90:5:5', help='ratio of Q:A:D')
+    parser.add_argument('--latency-commands', type=int, default=2000, help='prefix of workload run in closed loop, 0 to skip')
+    parser.add_argument('--counters', action='store_true', help='cache misses per query byte (needs perf)')
+    parser.add_argument('--targets', default='run,ref', help='comma separated binaries in project1')
+    parser.add_argument('--engines', help='comma separated engines, run is benchmarked once with each')
+    parser.add_argument('--generate', help='write <path>.init, <path>.work, <path>.result (expected output) and exit')
+    parser.add_argument('command', nargs='*', help='extra target command line (after --)')
+    args = parser.parse_args()
+
+    init, work = generate(args)
+    if args.generate:
+        with open(args.generate + '.init', 'w', encoding='latin-1', newline='') as f:
+            f.write(init)
+        with open(args.generate + '.work', 'w', encoding='latin-1', newline='') as f:
+            f.write(work)
+        with open(args.generate + '.result', 'w', encoding='latin-1', newline='') as f:
+            f.write(expected(init, work))
+        return
+
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    targets = []
+    for name in args.targets.split(','):
+        if name == 'run' and args.engines:
+            targets += [[os.path.join(root, name), '--engine=' + engine] for engine in args.engines.split(',')]
+        elif name:
+            targets.append([os.path.join(root, name)])
+    if args.command:
+        targets.append(args.command)
+
+    lines = work.split('\n')[:-1]
+    queries = sum(1 for line in lines if line[0] == 'Q')
+    query_bytes = sum(len(line) - 2 for line in lines if line[0] == 'Q')
+    if args.counters and not shutil.which('perf'):
+        print('perf not found, --counters ignored', file=sys.stderr)
+        args.counters = False
+    closed = '\n'.join(lines[:args.latency_commands]) + '\n'
+
+    report = {
+        'workload': {k: v for k, v in vars(args).items() if k not in ('targets', 'engines', 'generate', 'command', 'counters')},
+        'targets': {},
+    }
+    for command in targets:
+        result = throughput(command, init, work, len(lines), queries, query_bytes)
+        if args.latency_commands:
+            result['latency_us'] = latency(command, init, closed)
+        if args.counters:
+            result['counters'] = counters(command, init, work, query_bytes)
+        report['targets'][' '.join(command)] = result
+        print('done: {}'.format(' '.join(command)), file=sys.stderr)
+
+    digests = {result['digest'] for result in report['targets'].values()}
+    report['agree'] = len(digests) <= 1
+    json.dump(report, sys.stdout, indent=2)
+    print()
+
+
+if __name__ == '__main__':
+    main()
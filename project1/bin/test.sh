@@ -1,45 +1,76 @@
 #!/bin/bash
 
-make clean
-make all
+# usage: bin/test.sh, from project1, exits non-zero if any run fails
+# every fixture of test/data (init, work, result) under marker, once per run option set
+# fixtures are made by bin/bench.py --generate (expected output by its naive matcher):
+#   churn: --seed=2 --patterns=17000 --min-len=3 --max-len=12 --commands=16000 --mix=20:5:75 --query-len=120
+#       removes release half of states (reclaim), 17000 patterns build in parallel with --threads
+#   long: --seed=6 --patterns=1500 --min-len=3 --max-len=10 --commands=7 --mix=50:25:25 --query-len=1100000
+#       queries over half of input buffer, streamed in fragments inline and split in chunks in batch mode
+#   bytes: --seed=3 --alphabet=bytes --patterns=2000 --min-len=2 --max-len=4 --commands=3000 --mix=70:15:15 --query-len=300 --hit=0.8
+#       every byte but newline in patterns and queries (newline ends a command, so 255 classes is the most input reaches)
+#   repeat: --seed=7 --patterns=500 --min-len=3 --max-len=8 --commands=6000 --mix=94:3:3 --query-len=200 --distinct=40
+#       queries repeat across versions, cache variants hit, take repeats in a batch and drop stale entries
 
-# INIT TEST
-TEST_PATH="test/data/small"
-TEST_INIT="$TEST_PATH.init"
-TEST_WORK="$TEST_PATH.work"
-TEST_RESULT="$TEST_PATH.result"
+# marker of top Makefile has no source, test/marker builds it
+make run ref || exit 1
+make -C test/marker || exit 1
+make -C test/locate || exit 1
 
-WORK="./marker"
-RUN="./run"
+WORK="./test/marker/marker"
+RUN="$(pwd)/run"
 REF="./ref"
 
-# TEST COUNT LOAD
-TEST_NUM_FILE="log/count"
-TEST_NUM=0
-if [ ! -f "$TEST_NUM_FILE" ]
-then
-    echo "file does't exist"
-    echo "$TEST_NUM" > $TEST_NUM_FILE
-else
-    TEST_NUM=$(<$TEST_NUM_FILE)
-fi
+# marker runs a single executable, so options go in a wrapper
+WRAPPER_DIR=$(mktemp -d)
+trap 'rm -rf "$WRAPPER_DIR"' EXIT
 
-# Utility init
-TEST_FILE="log/LAB $TEST_NUM-$(date +%s)"
+# RUN OPTIONS, one marker run per fixture each
+# engines are forced, auto picks the map for every fixture
+# image twice: first run builds and saves it, second maps it (restored on first A, D)
+VARIANTS=(
+    ""
+    "--threads=4"
+    "--threads=4 --chunk=64"
+    "--layout=sparse --threads=2 --chunk=4096"
+    "--engine=memmem --threads=4"
+    "--engine=rabin-karp --threads=4 --chunk=64"
+    "--cache=1"
+    "--cache=1 --threads=4 --chunk=64"
+    "--hugepages=1 --threads=4"
+    "--hugepages=1 --layout=sparse --threads=4 --chunk=64"
+    "--image=$WRAPPER_DIR/image"
+    "--image=$WRAPPER_DIR/image"
+)
 
-TEST_INFO="LAB $TEST_NUM
-LAB_TIME: $(date +%s)
-TEST_MESSAGE: $1
-"
+FAILED=0
+for TEST_INIT in test/data/*.init; do
+    TEST_PATH="${TEST_INIT%.init}"
+    TEST_WORK="$TEST_PATH.work"
+    TEST_RESULT="$TEST_PATH.result"
+    [ -f "$TEST_WORK" ] && [ -f "$TEST_RESULT" ] || continue
 
-# RUN TEST
-RESULT_RUN=`$WORK $TEST_INIT $TEST_WORK $TEST_RESULT $RUN`
-RESULT_REF=`$WORK $TEST_INIT $TEST_WORK $TEST_RESULT $REF`
+    for i in "${!VARIANTS[@]}"; do
+        WRAPPER="$WRAPPER_DIR/run$i"
+        printf '#!/bin/sh\nexec %s %s "$@"\n' "$RUN" "${VARIANTS[$i]}" > "$WRAPPER"
+        chmod +x "$WRAPPER"
 
-echo "$TEST_INFO $RESULT_RUN" > "$TEST_FILE-RUN"
-echo "$TEST_INFO $RESULT_REF" > "$TEST_FILE-REF"
+        RESULT_RUN=$($WORK "$TEST_INIT" "$TEST_WORK" "$TEST_RESULT" "$WRAPPER" 2>&1)
+        if echo "$RESULT_RUN" | grep -q "Passed!"; then
+            echo "passed: $TEST_PATH run ${VARIANTS[$i]}"
+        else
+            echo "FAILED: $TEST_PATH run ${VARIANTS[$i]}"
+            echo "$RESULT_RUN" | grep -m 5 "mismatch"
+            FAILED=1
+        fi
+    done
+done
 
-echo "$RESULT_RUN"
+# ref handles a-z patterns only, compared on tiny workload
+RESULT_REF=$($WORK test/data/tiny.init test/data/tiny.work test/data/tiny.result $REF 2>&1)
+echo "$RESULT_REF" | grep -q "Passed!" && echo "passed: test/data/tiny ref" || { echo "FAILED: test/data/tiny ref"; FAILED=1; }
 
-echo $((TEST_NUM + 1)) > $TEST_NUM_FILE
+# locate() and counts of each matching path against scan(), on same fixtures
+test/locate/locate && echo "passed: test/locate" || { echo "FAILED: test/locate"; FAILED=1; }
 
+exit $FAILED
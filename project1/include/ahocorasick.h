@@ -1,78 +1,313 @@
+#ifndef AHOCORASICK_H
+#define AHOCORASICK_H
+
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #include <vector>
 #include <string>
 #include <list>
-#include <unordered_map>
+#include <set>
 #include <queue>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-using TABLE = std::vector<std::vector<int>>;
+#include <automaton.h>
+#include <image.h>
+#include <cache.h>
+#include <trace.h>
+#include <shared.h>
+#include <pool.h>
+#include <unique.h>
 
 using namespace std;
 
-#define CHAR_SIZE (26)
-#define CHAR_START ('a')
+// build() runs in parallel only for at least this many patterns, below it threads cost more than they save
+#define PARALLEL_BUILD_MIN (1 << 14)
+// states of a level resolved by one task of parallel build()
+#define PARALLEL_LEVEL_CHUNK (1 << 12)
+// map is rebuilt into fresh arrays once released states are this percent of it (and it has this many states)
+#define RECLAIM_PERCENT (50)
+#define RECLAIM_MIN_STATES (1 << 12)
+// engine selection (Options::engine AUTO), see select()
+// - MEMMEM for at most this many patterns
+// - RABIN_KARP for patterns of at most ENGINE_PACKED bytes, of at most this many distinct lengths,
+//       whose dense map is at least this large (no longer fits in cache),
+//       while its rebuild takes at most 1/ENGINE_REBUILD_SHARE of time between versions
+#define ENGINE_MEMMEM_MAX (8)
+#define ENGINE_HASH_LENGTHS (2)
+#define ENGINE_HASH_MAP_BYTES (32 << 20)
+#define ENGINE_REBUILD_SHARE (10)
+// tries of follower to map latest shared version, each miss means publisher replaced it meanwhile
+#define SHARED_RETRIES (8)
 
+/**
+* Table
+* builder of aho-corasick map, publish immutable Automaton versions for readers.
+* - add, remove are queued, builder thread applies them to map and publishes next version
+* - readers take snapshot() and match without any lock, old versions are released
+*       when no reader holds them (shared_ptr), so matching never waits on pattern updates
+*       except for the version it must see.
+* - shared: every version is published to a POSIX shared memory map as well (Options::shared),
+*       Table of follow() in other processes matches on the same pages, one copy of map per host.
+*/
 class Table {
 public:
-    std::set<std::string> patterns;
+    typedef Automaton::Hit Hit;
+
+    // owned by builder thread after construction, hash indexed so add, remove is O(1)
+    unique::string_vector patterns;
+
+    /**
+    * Options
+    * - layout: Automaton::Layout, map layout of published versions
+    * - hugepages: versions of a whole build() are one block backed by huge pages
+    * - threads: threads of build(), 1 builds on builder (or constructing) thread only
+    * - engine: Automaton::Engine of every version, AUTO selects one per version from pattern set
+    * - cache: bytes of query result cache (see cache()), 0 for none
+    * - trace: Trace of sync() (time, updates, builds, reclaims), nullptr records nothing; caller owns it
+    * - shared: name of shared memory map every version is published to (shared::Publisher), empty for none
+    */
+    struct Options {
+        Automaton::Layout layout;
+        bool hugepages;
+        size_t threads;
+        Automaton::Engine engine;
+        size_t cache;
+        Trace* trace;
+        std::string shared;
+
+        Options()
+            : layout(Automaton::DENSE), hugepages(false), threads(1), engine(Automaton::AUTO), cache(0), trace(nullptr) {}
+    };
+
+    /**
+    * build aho-corasick map first time, publish it as version 0 and start builder thread.
+    * @param: patterns; Iterable of string, duplicates are dropped
+    * @param: options; Options
+    * @see build()
+    */
+    template <typename Iterable>
+    Table(const Iterable& patterns, const Options& options = Options())
+        : patterns(patterns), layout(options.layout), hugepages(options.hugepages), threads(options.threads),
+          engine(options.engine), results(options.cache ? new Cache(options.cache) : nullptr), trace(options.trace) {
+        if (!options.shared.empty())
+            publisher.reset(new shared::Publisher(options.shared));
+        build();
+        publish(0);
+        builder = std::thread([this]() { run(); });
+    }
+
+    /**
+    * open image saved by save(), map it and publish as version 0 without building
+    * @param: path; image file
+    * @param: digest; hash of pattern set caller expects, image of another set is stale
+    * @param: options; Options, image must be saved in its layout
+    * @return: Table*, nullptr if image is missing, stale or corrupt (caller builds instead)
+    * readers match on mapped pages at once, builder thread copies map back
+    * into its own arrays only when first add, remove arrives, so a process that
+    * never updates keeps only shared page cache of image.
+    */
+    static Table* open(const std::string& path, uint64_t digest, const Options& options = Options()) {
+        Automaton::Layout layout = options.layout;
+        std::shared_ptr<const image::View> mapping = std::make_shared<const image::Mapping>(path);
+        if (!readable(*mapping))
+            return nullptr;
+
+        // builder arrays are restored from image
+        const image::Header& header = mapping->header();
+        uint64_t states = header.states;
+        bool ok = header.digest == digest && header.layout == uint32_t(layout)
+            && mapping->count<int>(image::RAW) == states * header.width
+            && mapping->count<int>(image::PARENT) == states
+            && mapping->count<int>(image::LABEL) == states && mapping->count<int>(image::COUNT) == states
+            && mapping->count<int>(image::FCHILD) == states && mapping->count<int>(image::FNEXT) == states
+            && mapping->count<int>(image::FPREV) == states;
+        return ok ? new Table(mapping, options) : nullptr;
+    }
 
     /**
-    * build aho-corasick map first time.
-    * @see update_table()
+    * follow shared map published by Table of Options::shared in another process
+    * @param: name; shared memory map, as Options::shared of publisher
+    * @param: options; Options, layout is taken from map, engine and cache apply
+    * @return: Table*, nullptr if nothing readable is published under name yet (caller retries)
+    * snapshot() switches to latest published version, pages of map are shared by every follower.
+    * follower has no builder, add, remove are ignored (patterns are publisher's).
     */
-    Table(const std::set<std::string>& patterns) : patterns(patterns) {
-        for (const auto& pattern : patterns) {
-            table_size += pattern.length() + 1;
+    static Table* follow(const std::string& name, const Options& options = Options()) {
+        std::unique_ptr<shared::Subscriber> subscriber(new shared::Subscriber(name));
+        if (!subscriber->valid() || !subscriber->sequence())
+            return nullptr;
+        Table* table = new Table(std::move(subscriber), options);
+        if (!std::atomic_load(&table->current)) {
+            delete table;
+            return nullptr;
         }
+        return table;
+    }
 
-        state_init = patterns.size();
-        state_num = state_init + 1;
-        state = state_init;
+    /**
+    * sharing
+    * @return: versions are published to shared memory, false if none was asked or it could not be created
+    */
+    bool sharing() const {
+        return publisher && publisher->valid();
+    }
 
-        raw = std::vector<std::vector<int>>(table_size, std::vector<int>(CHAR_SIZE, -1));
+    /**
+    * published_elsewhere
+    * @return: versions are not shared because another process publishes map of that name (see shared::Publisher)
+    */
+    bool published_elsewhere() const {
+        return publisher && publisher->busy();
+    }
+
+    /**
+    * save map to image file, open() maps it back
+    * @param: path; image file, written to path.tmp and renamed, so it's never half written
+    * @param: digest; hash of pattern set, open() checks it
+    * @return: false if it could not be written
+    * builder thread owns map once add, remove are called, so save before them.
+    */
+    bool save(const std::string& path, uint64_t digest) {
+        image::Writer writer;
+        Flat flat;
+        prepare(writer, flat);
+        writer.header.digest = digest;
+
+        writer.add(image::PARENT, parent);
+        writer.add(image::LABEL, label);
+        writer.add(image::COUNT, count);
+        writer.add(image::FCHILD, fchild);
+        writer.add(image::FNEXT, fnext);
+        writer.add(image::FPREV, fprev);
+        writer.add(image::FREE_STATES, free_states);
+        writer.add(image::FREE_WORDS, free_words);
+        writer.add(image::LENGTHS, lengths);
+        return writer.write(path);
+    }
 
-        for (const auto& pattern : patterns) {
-            update_table(pattern);
+    ~Table() {
+        {
+            std::unique_lock<std::mutex> lock(qutex);
+            stop = true;
         }
+        cond.notify_all();
+        if (builder.joinable())
+            builder.join();
     }
 
     /**
     * find matched patterns in input query
     * @param: query; const string&
     * @return: matched pattern list, it's already unique.
-    * - call sync() to synchronize aho-corasick map if patterns changed.
-    * - follow aho-corasick map and find matched patterns
+    * repeated query on same version is answered from cache() if there is one
+    * @see snapshot(), Automaton::search()
     */
     list<string> match(const string& query) {
-        unsigned int start;
-        unsigned int pos;
-        int state;
-
-        sync();
+        std::shared_ptr<const Automaton> automaton = snapshot();
+        if (!results)
+            return automaton->search(query);
 
-        list<string> result;
-        for (start = 0; start < query.length(); start++) {
-            string r = "";
-            state = state_init;
-            pos = start;
-            do {
-                r += query[pos];
-                state = raw[state][query[pos++] - CHAR_START];
-                if (state < state_init && state > -1) {
-                    auto iter = find(result.begin(), result.end(), r);
-                    if (iter == result.end())
-                        result.push_back(r);
-                }
-            } while ((state != -1) && (pos < query.length()));
+        std::vector<Hit> hits;
+        uint64_t key = Cache::hash(query.data(), query.length());
+        if (!results->get(automaton->version, key, query.data(), query.length(), hits)) {
+            Automaton::Matches matches;
+            automaton->scan(query, 0, query.length(), matches);
+            hits.swap(matches.hits);
+            results->put(automaton->version, key, query.data(), query.length(), hits);
         }
+        list<string> result;
+        for (const auto& hit : hits)
+            result.push_back(automaton->pattern(hit.second).str());
         return result;
     }
 
+    /**
+    * cache
+    * @return: Cache*, results of queries by version, nullptr if Options::cache is 0
+    * entries of older versions are dropped lazily, on lookup or instead of an eviction
+    */
+    Cache* cache() {
+        return results.get();
+    }
+
+    /**
+    * find matched patterns with position in input query
+    * @param: query; const string&
+    * @param: result; vector<Automaton::Match>&, (pattern id, first offset, occurrences) in order of first occurrence
+    * @param: count; bool, count occurrences (0 if false)
+    * @return: version ids of result belong to, Automaton::pattern(id) is the pattern
+    * @see Automaton::locate()
+    */
+    std::shared_ptr<const Automaton> locate(const string& query, vector<Automaton::Match>& result, bool count = false) {
+        std::shared_ptr<const Automaton> automaton = snapshot();
+        Automaton::Matches matches;
+        matches.counting = count;
+        automaton->locate(query.data(), query.length(), matches, result);
+        return automaton;
+    }
+
+    /**
+    * stream
+    * @return: Automaton::Stream on latest version, feed it query fragments as they arrive
+    * @see snapshot()
+    */
+    Automaton::Stream stream() {
+        return Automaton::Stream(snapshot());
+    }
+
+    /**
+    * snapshot
+    * @return: latest version, includes every add, remove called before
+    * waits only if builder has not published that version yet.
+    */
+    std::shared_ptr<const Automaton> snapshot() {
+        if (subscriber)
+            refresh();
+        size_t target = requested.load();
+        std::shared_ptr<const Automaton> automaton = std::atomic_load(&current);
+        if (automaton->version >= target)
+            return automaton;
+
+        // don't pin stale version while waiting, it may be a whole map before reclaim()
+        automaton.reset();
+        std::unique_lock<std::mutex> lock(qutex);
+        ready.wait(lock, [this, target]() -> bool {
+            return built >= target;
+        });
+        return std::atomic_load(&current);
+    }
+
+    // pending add and remove cancel each other, so the last command on a pattern wins
     void add(const string& pattern) {
-        pre_add.insert(pattern);
+        if (subscriber)
+            return;
+        {
+            std::unique_lock<std::mutex> lock(qutex);
+            pre_rem.erase(pattern);
+            pre_add.insert(pattern);
+            ++requested;
+        }
+        cond.notify_one();
     }
 
     void remove(const string& pattern) {
-        pre_rem.insert(pattern);
+        if (subscriber)
+            return;
+        {
+            std::unique_lock<std::mutex> lock(qutex);
+            pre_add.erase(pattern);
+            pre_rem.insert(pattern);
+            ++requested;
+        }
+        cond.notify_one();
     }
 
     int init_state() const {
@@ -80,96 +315,1264 @@ public:
     }
 
 private:
-    int table_size = 0;
-
-    int state_final = 0;
+    Automaton::Layout layout;
+    bool hugepages = false;
+    size_t threads = 1;
+    Automaton::Engine engine = Automaton::AUTO;
+    std::unique_ptr<Cache> results;
+    Trace* trace = nullptr;
+    // publisher: every version goes to shared memory too
+    // subscriber: follower of another process's map, followed is sequence of its current version
+    std::unique_ptr<shared::Publisher> publisher;
+    std::unique_ptr<shared::Subscriber> subscriber;
+    std::atomic<uint64_t> followed{0};
+    // engine selection, by builder thread (follower: under qutex), see select()
+    // selected: time of last select, interval: average time between versions, 0 until second one
+    // rebuild: ns per pattern of last RabinKarp build, 0 until first one
+    uint64_t selected = 0;
+    uint64_t interval = 0;
+    double rebuild = 0;
+    // image opened by open(), builder thread restores map from it and drops it
+    std::shared_ptr<const image::View> mapped;
     int state_init = 0;
-    int state_num = 0;
-    int state = 0;
-    int pre_state = 0;
-    char pre_char = 0;
+    int width = 1;
+    ClassId classes[ALPHABET_SIZE] = {};
+
+    // classes: byte to equivalence class, every byte used by patterns has its own class,
+    //      bytes never used share class 0 (always back to init state), width is number of classes
+    //      (up to ALPHABET_SIZE + 1 if every byte is used, so a class does not fit a byte)
+    // raw: dense map, raw[state * width + class] is next state (goto or failure already resolved)
+    // fail: failure link, longest proper suffix of state which is also in trie
+    // word: pattern id accepted at state, -1 if not final state
+    // emit: output link, nearest final state on failure chain (including itself), -1 if none
+    std::vector<int> raw;
+    std::vector<int> fail;
+    std::vector<int> word;
+    std::vector<int> emit;
+    std::vector<std::string> words;
 
-    std::vector<std::vector<int>> raw;
+    // pending add, remove and version requested by them, guarded by qutex
+    // built: last published version, readers wait on `ready` for it
     std::set<std::string> pre_add, pre_rem;
+    std::atomic<size_t> requested{0};
+    size_t built = 0;
+    bool stop = false;
+    std::mutex qutex;
+    std::condition_variable cond, ready;
+    std::thread builder;
+    std::shared_ptr<const Automaton> current;
+
+    // segments changed since last publish, others are shared with previous version
+    std::vector<bool> dirty_states, dirty_words;
+
+    // lengths: number of patterns of each length, to keep max_len when longest one removed
+    std::vector<int> lengths;
+    size_t max_len = 0;
+
+    // trie bookkeeping for incremental update
+    // parent, label: goto edge into state, raw[parent * width + label] is goto iff parent matches
+    // count: number of patterns pass through state, state is released when it drops to zero
+    // fchild, fnext, fprev: failure tree as intrusive list, children of state are states fail into it
+    std::vector<int> parent;
+    std::vector<int> label;
+    std::vector<int> count;
+    std::vector<int> fchild, fnext, fprev;
+    std::vector<int> free_states, free_words;
+    std::vector<int> frontier;
+    bool reclaimed = false;
+
+    // see open()
+    Table(const std::shared_ptr<const image::View>& mapping, const Options& options)
+        : layout(options.layout), hugepages(options.hugepages), threads(options.threads), engine(options.engine),
+          results(options.cache ? new Cache(options.cache) : nullptr), trace(options.trace), mapped(mapping) {
+        if (!options.shared.empty())
+            publisher.reset(new shared::Publisher(options.shared));
+        adopt(mapping->header());
+        std::shared_ptr<const image::View> view = mapped;
+        if (publisher && publisher->valid()) {
+            std::shared_ptr<const image::View> segment = publisher->publish(*mapped);
+            if (segment)
+                view = segment;
+        }
+        publish_view(0, view);
+        builder = std::thread([this]() { run(); });
+    }
+
+    // see follow(), no builder thread
+    Table(std::unique_ptr<shared::Subscriber> subscriber, const Options& options)
+        : layout(options.layout), engine(options.engine), results(options.cache ? new Cache(options.cache) : nullptr),
+          trace(options.trace), subscriber(std::move(subscriber)) {
+        refresh();
+    }
+
+    // fields of map header, follower takes them from each version (width changes on full rebuild)
+    void adopt(const image::Header& header) {
+        layout = Automaton::Layout(header.layout);
+        state_init = header.state_init;
+        width = header.width;
+        max_len = header.max_len;
+        std::copy(header.classes, header.classes + ALPHABET_SIZE, classes);
+    }
 
     /**
-    * sync aho-corasick map, process lazy sync (synchronize map when needed(process find match))
-    * - Caclculate changed table_size, if larger, resize map size
-    * - rebuild aho-corasick map
-    *       It's not necessary, and slow. But delete process disarrange map.
-    *       I find O(n) deleteion, but return query mismatch randomly(also in single thread; @see also single branch).
+    * readable
+    * @return: view holds a map readers can match on, header and reader sections agree
+    * RAW may be empty if map is sparse or narrow, as in images only readers use (Block, shared)
     */
-    void sync() {
-        int _table_size = table_size;
+    static bool readable(const image::View& view) {
+        if (!view.valid())
+            return false;
+        const image::Header& header = view.header();
+        uint64_t states = header.states;
+        uint64_t segments = (states + STATE_SEGMENT - 1) >> STATE_SHIFT;
+        size_t raw = view.count<int>(image::RAW), raw16 = view.count<uint16_t>(image::RAW16);
+        bool sparse = header.layout == Automaton::SPARSE;
+        bool ok = (sparse || header.layout == Automaton::DENSE)
+            && header.width >= 1 && header.width <= ALPHABET_SIZE && header.blocks == (header.width + 63) / 64
+            && header.state_init >= 0 && uint64_t(header.state_init) < states
+            && (raw == states * header.width || (raw == 0 && (sparse || raw16 != 0)))
+            && (raw16 == 0 || (!sparse && states < NARROW_STATES && raw16 == states * header.width))
+            && view.count<int>(image::FAIL) == states && view.count<int>(image::WORD) == states
+            && view.count<int>(image::EMIT) == states
+            && view.count<uint64_t>(image::WORD_OFFSETS) == header.words + 1
+            && view.section<uint64_t>(image::WORD_OFFSETS)[header.words] == view.count<char>(image::WORD_BYTES)
+            && view.count<int>(image::LENGTHS) > header.max_len;
+        if (ok && sparse) {
+            ok = view.count<uint64_t>(image::BITS) == states * header.blocks
+                && view.count<int>(image::BASE) == states
+                && view.count<int>(image::CHILD_OFFSETS) == segments;
+        }
+        return ok;
+    }
 
-        if (pre_add.empty() && pre_rem.empty())
+    /**
+    * refresh
+    * follower, switch to latest version publisher has stored, one load of shared page if there is none
+    * a version unlinked before it is mapped (publisher moved on) is skipped for newer one,
+    * current version is kept if none is readable in SHARED_RETRIES tries, and `followed` too,
+    * so next snapshot() tries again instead of taking the missed version as followed.
+    */
+    void refresh() {
+        uint64_t sequence = subscriber->sequence();
+        if (sequence == followed.load(std::memory_order_acquire))
             return;
+        // load again under lock, another reader may have switched to a newer one meanwhile
+        std::unique_lock<std::mutex> lock(qutex);
+        sequence = subscriber->sequence();
+        for (int tries = 0; tries < SHARED_RETRIES && sequence != followed.load(); tries++) {
+            std::shared_ptr<const image::View> segment = subscriber->open(sequence);
+            if (segment && readable(*segment)) {
+                adopt(segment->header());
+                publish_view(sequence, segment);
+                followed.store(sequence, std::memory_order_release);
+                return;
+            }
+            sequence = subscriber->sequence();
+        }
+    }
+
+    /**
+    * run
+    * builder thread, take every pending add, remove at once and publish them as one version
+    */
+    void run() {
+        for (;;) {
+            std::set<std::string> adds, rems;
+            size_t version;
+            {
+                std::unique_lock<std::mutex> lock(qutex);
+                cond.wait(lock, [this]() -> bool {
+                    return stop || requested.load() != built;
+                });
+                if (stop)
+                    return;
+                adds.swap(pre_add);
+                rems.swap(pre_rem);
+                version = requested.load();
+            }
 
-        for (const auto& pattern : pre_add) {
-            patterns.insert(pattern);
-            _table_size += pattern.length() + 1;
+            uint64_t begin = trace ? Trace::now() : 0;
+            // opened image stays mapped (page cache shared by processes) until an update needs builder arrays
+            if (mapped)
+                restore();
+            sync(adds, rems);
+            publish(version);
+            if (trace) {
+                trace->sync.record(Trace::now() - begin);
+                trace->updates.fetch_add(adds.size() + rems.size(), std::memory_order_relaxed);
+            }
+            {
+                std::unique_lock<std::mutex> lock(qutex);
+                built = version;
+            }
+            ready.notify_all();
+
+            // segments of previous versions are small blocks, return their pages once reclaimed
+            if (reclaimed) {
+                reclaimed = false;
+#ifdef __GLIBC__
+                malloc_trim(0);
+#endif
+            }
+        }
+    }
+
+    /**
+    * sync aho-corasick map with pending add, remove
+    * - apply remove, add to map one by one
+    *       each costs about pattern length plus the failure subtree which it changes,
+    *       not a rebuild of whole map.
+    * - if added pattern has a byte without class, width of every row changes,
+    *       so apply them to pattern set and rebuild whole map (rare, alphabet is bounded).
+    * - if removes left most states released, reclaim() them
+    */
+    void sync(const std::set<std::string>& adds, const std::set<std::string>& rems) {
+        for (const auto& pattern : adds) {
+            if (!classified(pattern)) {
+                for (const auto& rem : rems)
+                    patterns.erase(rem);
+                for (const auto& add : adds) {
+                    if (!add.empty())
+                        patterns.insert(add);
+                }
+                build();
+                if (trace)
+                    trace->builds.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
         }
-        
-        for (const auto& pattern : pre_rem) {
-            patterns.erase(pattern);
-            _table_size -= pattern.length() + 1;
+
+        for (const auto& pattern : rems) {
+            if (patterns.erase(pattern) && !pattern.empty())
+                erase_table(pattern);
         }
 
-        if (_table_size > table_size) {
-            raw.resize(_table_size, std::vector<int>(CHAR_SIZE, -1));
+        for (const auto& pattern : adds) {
+            if (!pattern.empty() && patterns.insert(pattern))
+                insert_table(pattern);
         }
 
-        table_size = _table_size;
+        if (fail.size() >= RECLAIM_MIN_STATES && free_states.size() * 100 >= fail.size() * RECLAIM_PERCENT)
+            reclaim();
+    }
 
-        for (int i = 0; i < state_num + 1; i++) {
-            fill(raw[i].begin(), raw[i].end(), -1);
+    /**
+    * reclaim
+    * rebuild map of live patterns into arrays of its size, released states are reused
+    * but arrays never shrink otherwise, so memory tracks largest pattern set ever.
+    * - trie keeps exactly the prefixes of live patterns, so live states are known before build()
+    * - states are numbered breadth-first again, pattern ids are packed
+    * costs a build() of live patterns, at most once per as many removes as there are live states.
+    */
+    void reclaim() {
+        size_t states = fail.size() - free_states.size();
+        for (auto* array : {&raw, &fail, &word, &emit, &parent, &label, &count, &fchild, &fnext, &fprev,
+                            &free_states, &free_words, &frontier}) {
+            std::vector<int>().swap(*array);
         }
+        std::vector<std::string>().swap(words);
 
-        state_final = 0;
-        state_init = patterns.size();
-        state_num = state_init + 1;
-        state = state_init;
+        for (auto* array : {&fail, &word, &emit, &parent, &label, &count, &fchild, &fnext, &fprev})
+            array->reserve(states);
+        raw.reserve(states * width);
+        words.reserve(patterns.size());
+        build();
+        reclaimed = true;
+        if (trace)
+            trace->reclaims.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+    * publish
+    * @param: version; number of add, remove applied
+    * make Automaton of current map, copy only segments changed since last version
+    */
+    void publish(size_t version) {
+        if (publisher && share(version))
+            return;
 
-        for (const auto& pattern : patterns) {
-            update_table(pattern);
+        // whole map changed, lay it out in one block instead of segment by segment
+        if (hugepages && dirty_states.empty()) {
+            image::Writer writer;
+            Flat flat;
+            prepare(writer, flat);
+            // sparse and narrow versions never read int rows
+            if (layout == Automaton::SPARSE || narrow())
+                writer.add(image::RAW, raw.data(), 0);
+            std::shared_ptr<const image::View> block = std::make_shared<const image::Block>(writer);
+            if (block->valid()) {
+                publish_view(version, block);
+                return;
+            }
+        }
+
+        std::shared_ptr<Automaton> automaton = std::make_shared<Automaton>();
+        std::shared_ptr<const Automaton> prev = std::atomic_load(&current);
+
+        automaton->version = version;
+        automaton->state_init = state_init;
+        automaton->max_len = max_len;
+        automaton->width = width;
+        automaton->layout = layout;
+        automaton->blocks = (width + 63) / 64;
+        automaton->states = fail.size();
+        automaton->narrow = narrow();
+        std::copy(classes, classes + ALPHABET_SIZE, automaton->classes);
+
+        bool starts[ALPHABET_SIZE];
+        first_bytes(starts);
+        automaton->prefilter.build(starts);
+
+        // index type changed (map grew past or shrank below NARROW_STATES), every segment is copied
+        size_t segments = (fail.size() + STATE_SEGMENT - 1) >> STATE_SHIFT;
+        for (size_t i = 0; i < segments; i++) {
+            if (prev && prev->narrow == automaton->narrow && i < dirty_states.size() && !dirty_states[i]) {
+                automaton->share(*prev, i);
+                continue;
+            }
+
+            std::shared_ptr<Automaton::Segment> segment = std::make_shared<Automaton::Segment>();
+            size_t begin = i << STATE_SHIFT;
+            size_t end = std::min(fail.size(), begin + STATE_SEGMENT);
+            if (layout == Automaton::SPARSE)
+                compact(*segment, begin, end, automaton->blocks);
+            else if (automaton->narrow)
+                segment->raw16.assign(raw.begin() + begin * width, raw.begin() + end * width);
+            else
+                segment->raw.assign(raw.begin() + begin * width, raw.begin() + end * width);
+            segment->fail.assign(fail.begin() + begin, fail.begin() + end);
+            segment->word.assign(word.begin() + begin, word.begin() + end);
+            segment->emit.assign(emit.begin() + begin, emit.begin() + end);
+            automaton->attach(std::shared_ptr<const Automaton::Segment>(segment));
         }
 
-        pre_add.clear();
-        pre_rem.clear();
+        size_t word_segments = (words.size() + WORD_SEGMENT - 1) >> WORD_SHIFT;
+        for (size_t i = 0; i < word_segments; i++) {
+            if (prev && i < dirty_words.size() && !dirty_words[i]) {
+                automaton->share_words(*prev, i);
+                continue;
+            }
+
+            size_t begin = i << WORD_SHIFT;
+            size_t end = std::min(words.size(), begin + WORD_SEGMENT);
+            std::shared_ptr<Automaton::Words> segment = std::make_shared<Automaton::Words>();
+            segment->offsets.reserve(WORD_SEGMENT + 1);
+            segment->offsets.push_back(0);
+            for (size_t id = begin; id < end; id++) {
+                segment->bytes += words[id];
+                segment->offsets.push_back(segment->bytes.size());
+            }
+            segment->offsets.resize(WORD_SEGMENT + 1, segment->bytes.size());
+            automaton->attach(std::shared_ptr<const Automaton::Words>(segment));
+        }
+
+        select(*automaton, lengths.data(), lengths.size(), words.size());
+        dirty_states.assign(segments, false);
+        dirty_words.assign(word_segments, false);
+        std::atomic_store(&current, std::shared_ptr<const Automaton>(automaton));
+    }
+
+    /**
+    * select
+    * @param: automaton; Automaton&, version whose map and patterns are attached
+    * @param: histogram, size; number of patterns of each length
+    * @param: ids; upper bound of pattern id, released ids are empty
+    * pick engine of version from shape of pattern set (count, length histogram, alphabet width),
+    * re-evaluated on every publish, so a set growing past a few patterns goes back to the map.
+    * - a handful of patterns: MEMMEM, a vector search per pattern beats walking every byte
+    * - many patterns of a few short lengths, alphabet wide enough that dense map outgrows cache:
+    *       RABIN_KARP, a probe per length into tables far smaller than map
+    * - otherwise AUTOMATON, whose cost does not grow with pattern count
+    * MEMMEM, RABIN_KARP are rebuilt from every pattern on each publish (not incremental).
+    * MEMMEM holds a few patterns, its rebuild is negligible. RABIN_KARP rebuild grows with set,
+    * so under frequent updates (rebuild over 1/ENGINE_REBUILD_SHARE of time between versions)
+    * set stays on the map, whose publish copies changed segments only; it goes back to RABIN_KARP
+    * on first version after updates slow down.
+    */
+    void select(Automaton& automaton, const int* histogram, size_t size, size_t ids) {
+        // time between versions: shorter of last one and average, a burst of updates counts at once
+        uint64_t now = Trace::now(), recent = 0;
+        if (selected) {
+            recent = now - selected;
+            interval = interval ? (interval * 3 + recent) / 4 : recent;
+            recent = std::min(recent, interval);
+        }
+        selected = now;
+
+        size_t total = 0, distinct = 0;
+        for (size_t length = 1; length < size; length++) {
+            total += histogram[length];
+            distinct += histogram[length] != 0;
+        }
+
+        Automaton::Engine choice = engine;
+        if (choice == Automaton::AUTO) {
+            if (total == 0)
+                choice = Automaton::AUTOMATON;
+            else if (total <= ENGINE_MEMMEM_MAX)
+                choice = Automaton::MEMMEM;
+            else if (max_len <= ENGINE_PACKED && distinct <= ENGINE_HASH_LENGTHS
+                && automaton.states * width * (automaton.narrow ? sizeof(uint16_t) : sizeof(int)) >= ENGINE_HASH_MAP_BYTES
+                && (recent == 0 || rebuild * total * ENGINE_REBUILD_SHARE <= recent))
+                choice = Automaton::RABIN_KARP;
+            else
+                choice = Automaton::AUTOMATON;
+        }
+
+        automaton.engine = choice;
+        if (choice == Automaton::MEMMEM) {
+            std::shared_ptr<Memmem> needles = std::make_shared<Memmem>();
+            for (size_t id = 0; id < ids; id++) {
+                Automaton::Pattern pattern = automaton.pattern(id);
+                if (pattern.length)
+                    needles->add(pattern.data, pattern.length, id);
+            }
+            automaton.needles = needles;
+        } else if (choice == Automaton::RABIN_KARP) {
+            uint64_t begin = Trace::now();
+            std::shared_ptr<RabinKarp> hashes = std::make_shared<RabinKarp>();
+            for (size_t id = 0; id < ids; id++) {
+                Automaton::Pattern pattern = automaton.pattern(id);
+                if (pattern.length)
+                    hashes->add(pattern.data, pattern.length, id);
+            }
+            hashes->build();
+            automaton.hashes = hashes;
+            if (total)
+                rebuild = double(Trace::now() - begin) / total;
+        }
+    }
+
+    // sparse map and words of image, kept until image is written
+    struct Flat {
+        std::vector<uint64_t> bits;
+        std::vector<int> base, child, child_offsets;
+        std::vector<uint64_t> offsets;
+        std::string bytes;
+        std::vector<uint16_t> raw16;
+    };
+
+    /**
+    * share
+    * @param: version; number of add, remove applied
+    * @return: false if shared memory could not be written, caller publishes privately
+    * image of whole map is written to next shared version and published as view of it,
+    * so this process matches on the same pages as followers. costs a copy of map per version,
+    * pending add, remove queue up meanwhile and go to next version together.
+    */
+    bool share(size_t version) {
+        if (!publisher->valid())
+            return false;
+        image::Writer writer;
+        Flat flat;
+        prepare(writer, flat);
+        writer.add(image::LENGTHS, lengths);
+        // sparse and narrow versions never read int rows
+        if (layout == Automaton::SPARSE || narrow())
+            writer.add(image::RAW, raw.data(), 0);
+        std::shared_ptr<const image::View> segment = publisher->publish(writer);
+        if (!segment)
+            return false;
+        publish_view(version, segment);
+        return true;
+    }
+
+    /**
+    * narrow
+    * @return: dense map fits uint16_t states, versions are published with raw16
+    * re-evaluated on every publish, as states are added and reclaimed
+    */
+    bool narrow() const {
+        return layout == Automaton::DENSE && fail.size() < NARROW_STATES;
+    }
+
+    /**
+    * prepare
+    * @param: writer; image::Writer&, header and reader sections of map are added
+    * @param: flat; Flat&, holds sections made for image (sparse map, words)
+    */
+    void prepare(image::Writer& writer, Flat& flat) {
+        image::Header& header = writer.header;
+        header.layout = layout;
+        header.width = width;
+        header.state_init = state_init;
+        header.blocks = (width + 63) / 64;
+        header.max_len = max_len;
+        header.states = fail.size();
+        header.words = words.size();
+        std::copy(classes, classes + ALPHABET_SIZE, header.classes);
+        bool starts[ALPHABET_SIZE];
+        first_bytes(starts);
+        std::copy(starts, starts + ALPHABET_SIZE, header.starts);
+
+        writer.add(image::RAW, raw);
+        if (narrow())
+            flat.raw16.assign(raw.begin(), raw.end());
+        writer.add(image::RAW16, flat.raw16);
+        writer.add(image::FAIL, fail);
+        writer.add(image::WORD, word);
+        writer.add(image::EMIT, emit);
+
+        // sparse map, segment after segment as published
+        if (layout == Automaton::SPARSE) {
+            Automaton::Segment segment;
+            for (size_t begin = 0; begin < fail.size(); begin += STATE_SEGMENT) {
+                compact(segment, begin, std::min(fail.size(), begin + STATE_SEGMENT), header.blocks);
+                flat.child_offsets.push_back(flat.child.size());
+                flat.bits.insert(flat.bits.end(), segment.bits.begin(), segment.bits.end());
+                flat.base.insert(flat.base.end(), segment.base.begin(), segment.base.end());
+                flat.child.insert(flat.child.end(), segment.child.begin(), segment.child.end());
+            }
+        }
+        writer.add(image::BITS, flat.bits);
+        writer.add(image::BASE, flat.base);
+        writer.add(image::CHILD, flat.child);
+        writer.add(image::CHILD_OFFSETS, flat.child_offsets);
+
+        flat.offsets.assign(1, 0);
+        for (const auto& pattern : words) {
+            flat.bytes += pattern;
+            flat.offsets.push_back(flat.bytes.size());
+        }
+        writer.add(image::WORD_OFFSETS, flat.offsets);
+        writer.add(image::WORD_BYTES, flat.bytes.data(), flat.bytes.size());
+    }
+
+    /**
+    * publish_view
+    * @param: version; number of add, remove applied
+    * @param: view; image of map (mapped file, or huge page block)
+    * publish image as next version, segments are views of it
+    * so they are shared (not copied) by next versions until changed.
+    */
+    void publish_view(size_t version, const std::shared_ptr<const image::View>& view) {
+        const image::View& source = *view;
+        const image::Header& header = source.header();
+        std::shared_ptr<Automaton> automaton = std::make_shared<Automaton>();
+
+        automaton->version = version;
+        automaton->state_init = state_init;
+        automaton->max_len = max_len;
+        automaton->width = width;
+        automaton->layout = layout;
+        automaton->blocks = header.blocks;
+        automaton->states = header.states;
+        automaton->narrow = header.size[image::RAW16] != 0;
+        std::copy(classes, classes + ALPHABET_SIZE, automaton->classes);
+        bool starts[ALPHABET_SIZE];
+        std::copy(header.starts, header.starts + ALPHABET_SIZE, starts);
+        automaton->prefilter.build(starts);
+
+        const int* raw_ = source.section<int>(image::RAW);
+        const uint16_t* raw16_ = source.section<uint16_t>(image::RAW16);
+        const int* fail_ = source.section<int>(image::FAIL);
+        const int* word_ = source.section<int>(image::WORD);
+        const int* emit_ = source.section<int>(image::EMIT);
+        const uint64_t* bits_ = source.section<uint64_t>(image::BITS);
+        const int* base_ = source.section<int>(image::BASE);
+        const int* child_ = source.section<int>(image::CHILD);
+        const int* child_offsets = source.section<int>(image::CHILD_OFFSETS);
+
+        size_t segments = (header.states + STATE_SEGMENT - 1) >> STATE_SHIFT;
+        for (size_t i = 0; i < segments; i++) {
+            size_t begin = i << STATE_SHIFT;
+            automaton->attach(raw_ + begin * width, raw16_ + begin * width, fail_ + begin, word_ + begin, emit_ + begin,
+                bits_ + begin * header.blocks, base_ + begin,
+                layout == Automaton::SPARSE ? child_ + child_offsets[i] : child_);
+        }
+
+        const uint64_t* offsets = source.section<uint64_t>(image::WORD_OFFSETS);
+        const char* bytes = source.section<char>(image::WORD_BYTES);
+        size_t word_segments = (header.words + WORD_SEGMENT - 1) >> WORD_SHIFT;
+        for (size_t i = 0; i < word_segments; i++)
+            automaton->attach(offsets + (i << WORD_SHIFT), bytes);
+
+        automaton->storage = view;
+        automaton->storage_bytes = view == mapped ? 0 : source.size();
+        // builder arrays are restored from opened image on first add, remove, follower has none
+        if (mapped || subscriber)
+            select(*automaton, source.section<int>(image::LENGTHS), source.count<int>(image::LENGTHS), header.words);
+        else
+            select(*automaton, lengths.data(), lengths.size(), words.size());
+        dirty_states.assign(segments, false);
+        dirty_words.assign(word_segments, false);
+        std::atomic_store(&current, std::shared_ptr<const Automaton>(automaton));
+    }
+
+    /**
+    * restore
+    * copy map and pattern set of mapped image back to builder arrays,
+    * published versions keep mapping alive as long as they share its segments.
+    */
+    void restore() {
+        const image::View& mapping = *mapped;
+        auto load = [&mapping](std::vector<int>& to, image::Section section) {
+            const int* from = mapping.section<int>(section);
+            to.assign(from, from + mapping.count<int>(section));
+        };
+        load(raw, image::RAW);
+        load(fail, image::FAIL);
+        load(word, image::WORD);
+        load(emit, image::EMIT);
+        load(parent, image::PARENT);
+        load(label, image::LABEL);
+        load(count, image::COUNT);
+        load(fchild, image::FCHILD);
+        load(fnext, image::FNEXT);
+        load(fprev, image::FPREV);
+        load(free_states, image::FREE_STATES);
+        load(free_words, image::FREE_WORDS);
+        load(lengths, image::LENGTHS);
+
+        // released ids are empty, every other one is a live pattern
+        const uint64_t* offsets = mapping.section<uint64_t>(image::WORD_OFFSETS);
+        const char* bytes = mapping.section<char>(image::WORD_BYTES);
+        words.resize(mapping.header().words);
+        patterns.reserve(words.size());
+        for (size_t id = 0; id < words.size(); id++) {
+            words[id].assign(bytes + offsets[id], offsets[id + 1] - offsets[id]);
+            if (!words[id].empty())
+                patterns.insert(words[id]);
+        }
+        mapped.reset();
+    }
+
+    // first bytes are goto edges of root
+    void first_bytes(bool* starts) const {
+        for (int ch = 0; ch < ALPHABET_SIZE; ch++) {
+            int next = raw[state_init * width + classes[ch]];
+            starts[ch] = classes[ch] != 0 && next != state_init && parent[next] == state_init;
+        }
+    }
+
+    /**
+    * compact
+    * @param: segment; Automaton::Segment&, bits, base, child are filled
+    * @param: begin, end; states of segment
+    * @param: blocks; 64 bit blocks per state
+    * keep goto edges only (raw entry whose parent is the state), released states have none
+    */
+    void compact(Automaton::Segment& segment, size_t begin, size_t end, int blocks) {
+        segment.bits.assign((end - begin) * blocks, 0);
+        segment.base.resize(end - begin);
+        segment.child.clear();
+        for (size_t state = begin; state < end; state++) {
+            segment.base[state - begin] = segment.child.size();
+            if (parent[state] == -1 && int(state) != state_init)
+                continue;
+            for (int ch = 1; ch < width; ch++) {
+                int next = raw[state * width + ch];
+                if (next >= 0 && parent[next] == int(state)) {
+                    segment.bits[(state - begin) * blocks + (ch >> 6)] |= uint64_t(1) << (ch & 63);
+                    segment.child.push_back(next);
+                }
+            }
+        }
+        segment.child.shrink_to_fit();
+    }
+
+    // every byte of pattern has its own class
+    bool classified(const std::string& pattern) const {
+        for (char ch : pattern) {
+            if (classes[(unsigned char)ch] == 0)
+                return false;
+        }
+        return true;
+    }
+
+    // mark segment of state (or pattern id) changed
+    void touch(int state) {
+        if (size_t(state >> STATE_SHIFT) < dirty_states.size())
+            dirty_states[state >> STATE_SHIFT] = true;
+    }
+
+    void touch_word(int id) {
+        if (size_t(id >> WORD_SHIFT) < dirty_words.size())
+            dirty_words[id >> WORD_SHIFT] = true;
+    }
+
+    /**
+    * build
+    * build aho-corasick map using all patterns
+    * - insert every pattern to trie (goto function)
+    * - visit trie breadth-first, make failure link, output link
+    *       missing transition is filled with transition of failure state,
+    *       so map becomes DFA, match need no failure chasing.
+    * - large pattern set with threads > 1 is built by parallel_build(), same map
+    */
+    void build() {
+        std::fill(classes, classes + ALPHABET_SIZE, 0);
+        width = 1;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            const char* pattern = patterns.data(i);
+            for (size_t j = 0; j < patterns.length(i); j++) {
+                ClassId& cls = classes[(unsigned char)pattern[j]];
+                if (cls == 0)
+                    cls = width++;
+            }
+        }
+
+        // every segment is copied on next publish
+        dirty_states.clear();
+        dirty_words.clear();
+
+        raw.clear(); fail.clear(); word.clear(); emit.clear();
+        parent.clear(); label.clear(); count.clear();
+        fchild.clear(); fnext.clear(); fprev.clear();
+        words.clear(); free_states.clear(); free_words.clear();
+        lengths.clear(); max_len = 0;
+
+        if (threads > 1 && patterns.size() >= PARALLEL_BUILD_MIN) {
+            parallel_build();
+            return;
+        }
+
+        state_init = new_state(-1, -1);
+        update_table();
+
+        std::queue<int> bfs;
+        for (int ch = 0; ch < width; ch++) {
+            int& next = raw[state_init * width + ch];
+            if (next == -1) {
+                next = state_init;
+            } else {
+                link(next, state_init);
+                bfs.push(next);
+            }
+        }
+
+        while (!bfs.empty()) {
+            int state = bfs.front();
+            bfs.pop();
+
+            emit[state] = word[state] != -1 ? state : emit[fail[state]];
+            for (int ch = 0; ch < width; ch++) {
+                int& next = raw[state * width + ch];
+                int to = raw[fail[state] * width + ch];
+                if (next == -1) {
+                    next = to;
+                } else {
+                    link(next, to);
+                    bfs.push(next);
+                }
+            }
+        }
+    }
+
+    /**
+    * Subtrie
+    * patterns of one first byte, trie below root built by parallel_build()
+    * local states are numbered level by level in sorted order (as update_table() does),
+    * state 0 is the first byte itself.
+    * - order: pattern indices, sorted
+    * - parent, label, count: as Table members, parent -1 is root
+    * - accept: pattern index ending at state (-1 if none), finish: its rank among patterns ending at same depth
+    * - levels: levels[d] is first state of depth d + 1, last one is number of states
+    * - ends: ends[d] is number of patterns of length d + 1
+    */
+    struct Subtrie {
+        std::vector<int> order;
+        std::vector<int> parent, label, count, accept, finish;
+        std::vector<int> levels, ends;
+        // global state is local one plus base[d] (state of depth d + 1), word id is finish plus words[d]
+        std::vector<int> base, words;
+    };
+
+    /**
+    * parallel_build
+    * build() on `threads` threads, map is same as serial one (numbering, pattern ids, links)
+    * - partition patterns by first byte, sort and build each subtrie concurrently
+    *       sorted order groups patterns by prefix, so a state's children are made one after other
+    *       and trie is built without any row lookup.
+    * - serial numbering is breadth-first in sorted order, so level d of it is level d of each
+    *       subtrie in order of first byte: place subtries by prefix sums of level sizes,
+    *       copy them to global arrays concurrently.
+    * - failure links level by level, states of a level only read rows of lower levels
+    *       and write own rows (and links of own children), so a level is split in chunks.
+    */
+    void parallel_build() {
+        Thread::Pool pool(threads);
+        std::vector<Subtrie> subtries(ALPHABET_SIZE);
+        for (size_t i = 0; i < patterns.size(); i++) {
+            if (patterns.length(i))
+                subtries[(unsigned char)patterns.data(i)[0]].order.push_back(i);
+        }
+
+        // largest first, so a big subtrie does not start last
+        std::vector<int> bytes;
+        for (int ch = 0; ch < ALPHABET_SIZE; ch++) {
+            if (!subtries[ch].order.empty())
+                bytes.push_back(ch);
+        }
+        std::sort(bytes.begin(), bytes.end(), [&subtries](int a, int b) -> bool {
+            return subtries[a].order.size() > subtries[b].order.size();
+        });
+        for (int ch : bytes)
+            pool.push([this, &subtries, ch]() { build_subtrie(subtries[ch]); });
+        pool.wait();
+
+        // place levels: root, then level d of every subtrie in order of first byte
+        size_t depth = 0;
+        for (int ch : bytes)
+            depth = std::max(depth, subtries[ch].levels.size() - 1);
+        std::vector<int> level_begin(depth + 1, 0);
+        int states = 1, ids = 0;
+        for (size_t d = 0; d < depth; d++) {
+            level_begin[d] = states;
+            for (int ch = 0; ch < ALPHABET_SIZE; ch++) {
+                Subtrie& subtrie = subtries[ch];
+                if (d + 1 >= subtrie.levels.size())
+                    continue;
+                subtrie.base.push_back(states - subtrie.levels[d]);
+                states += subtrie.levels[d + 1] - subtrie.levels[d];
+            }
+        }
+        level_begin[depth] = states;
+        for (size_t d = 0; d < depth; d++) {
+            for (int ch = 0; ch < ALPHABET_SIZE; ch++) {
+                Subtrie& subtrie = subtries[ch];
+                if (d < subtrie.ends.size()) {
+                    subtrie.words.push_back(ids);
+                    ids += subtrie.ends[d];
+                }
+            }
+        }
+
+        state_init = 0;
+        raw.assign(size_t(states) * width, -1);
+        fail.assign(states, state_init);
+        word.assign(states, -1);
+        emit.assign(states, -1);
+        parent.assign(states, 0);
+        label.assign(states, 0);
+        count.assign(states, 0);
+        fchild.assign(states, -1);
+        fnext.assign(states, -1);
+        fprev.assign(states, -1);
+        parent[state_init] = label[state_init] = -1;
+        words.assign(ids, std::string());
+        for (size_t i = 0; i < patterns.size(); i++) {
+            size_t length = patterns.length(i);
+            if (!length)
+                continue;
+            if (lengths.size() <= length)
+                lengths.resize(length + 1, 0);
+            ++lengths[length];
+            max_len = std::max(max_len, length);
+        }
+
+        for (int ch : bytes)
+            pool.push([this, &subtries, ch]() { place_subtrie(subtries[ch]); });
+        pool.wait();
+        std::vector<Subtrie>().swap(subtries);
+
+        // failure links, root row first
+        for (int ch = 0; ch < width; ch++) {
+            int& next = raw[state_init * width + ch];
+            if (next == -1)
+                next = state_init;
+            else
+                fail[next] = state_init;
+        }
+        for (size_t d = 0; d < depth; d++) {
+            int begin = level_begin[d], end = level_begin[d + 1];
+            for (int from = begin; from < end; from += PARALLEL_LEVEL_CHUNK) {
+                int to = std::min(end, from + PARALLEL_LEVEL_CHUNK);
+                if (end - begin <= PARALLEL_LEVEL_CHUNK)
+                    link_level(from, to);
+                else
+                    pool.push([this, from, to]() { link_level(from, to); });
+            }
+            pool.wait();
+        }
+
+        // failure tree lists, only order of siblings differs from serial build
+        for (int state = states - 1; state > state_init; state--) {
+            int to = fail[state];
+            fnext[state] = fchild[to];
+            if (fchild[to] != -1)
+                fprev[fchild[to]] = state;
+            fchild[to] = state;
+        }
+    }
+
+    /**
+    * build_subtrie
+    * @param: subtrie; Subtrie&, order is patterns of one first byte
+    * level by level insertion of update_table(), patterns with same (state, next byte) are adjacent
+    * in sorted order, so next state is the last one made or a new one.
+    */
+    void build_subtrie(Subtrie& subtrie) {
+        std::vector<int>& order = subtrie.order;
+        std::sort(order.begin(), order.end(), [this](int a, int b) -> bool {
+            size_t la = patterns.length(a), lb = patterns.length(b);
+            int cmp = memcmp(patterns.data(a), patterns.data(b), std::min(la, lb));
+            return cmp != 0 ? cmp < 0 : la < lb;
+        });
+
+        std::vector<std::pair<int, int>> active;
+        active.reserve(order.size());
+        for (int i : order)
+            active.emplace_back(i, -1);
+
+        subtrie.levels.push_back(0);
+        for (size_t depth = 0; !active.empty(); depth++) {
+            int states = subtrie.parent.size();
+            int ends = 0;
+            size_t kept = 0;
+            for (size_t i = 0; i < active.size(); i++) {
+                int id = active[i].first;
+                int state = active[i].second;
+                int cls = classes[(unsigned char)patterns.data(id)[depth]];
+                int next = subtrie.parent.size() - 1;
+                if (next < states || subtrie.parent[next] != state || subtrie.label[next] != cls) {
+                    next = subtrie.parent.size();
+                    subtrie.parent.push_back(state);
+                    subtrie.label.push_back(cls);
+                    subtrie.count.push_back(0);
+                    subtrie.accept.push_back(-1);
+                    subtrie.finish.push_back(-1);
+                }
+                ++subtrie.count[next];
+
+                if (depth + 1 == patterns.length(id)) {
+                    subtrie.accept[next] = id;
+                    subtrie.finish[next] = ends++;
+                } else {
+                    active[kept++] = std::make_pair(id, next);
+                }
+            }
+            active.resize(kept);
+            subtrie.levels.push_back(subtrie.parent.size());
+            subtrie.ends.push_back(ends);
+        }
+        std::vector<int>().swap(order);
+    }
+
+    /**
+    * place_subtrie
+    * @param: subtrie; Subtrie&, placed by parallel_build()
+    * copy states of subtrie to global arrays, each subtrie owns its rows (and an entry of root row)
+    */
+    void place_subtrie(Subtrie& subtrie) {
+        for (size_t d = 0; d + 1 < subtrie.levels.size(); d++) {
+            for (int local = subtrie.levels[d]; local < subtrie.levels[d + 1]; local++) {
+                int state = local + subtrie.base[d];
+                int from = subtrie.parent[local] == -1 ? state_init : subtrie.parent[local] + subtrie.base[d - 1];
+                parent[state] = from;
+                label[state] = subtrie.label[local];
+                count[state] = subtrie.count[local];
+                raw[from * width + label[state]] = state;
+                if (subtrie.accept[local] != -1) {
+                    int id = subtrie.finish[local] + subtrie.words[d];
+                    word[state] = id;
+                    words[id] = patterns.at(subtrie.accept[local]);
+                }
+            }
+        }
+    }
+
+    /**
+    * link_level
+    * @param: begin, end; states of one level, links of lower levels are done
+    * failure link of children, output link, missing transitions of rows (as build() does)
+    */
+    void link_level(int begin, int end) {
+        for (int state = begin; state < end; state++) {
+            emit[state] = word[state] != -1 ? state : emit[fail[state]];
+            for (int ch = 0; ch < width; ch++) {
+                int& next = raw[state * width + ch];
+                int to = raw[fail[state] * width + ch];
+                if (next == -1)
+                    next = to;
+                else
+                    fail[next] = to;
+            }
+        }
     }
 
     /**
     * update_table
+    * insert every pattern to trie (goto function only, links are made in build())
+    * - patterns are sorted and inserted a level (depth) at a time, so states are numbered
+    *       in breadth-first order: root is 0, states of a level follow the level above
+    *       and siblings are adjacent.
+    * - states near root take almost every transition, so their rows share a few cache lines
+    *       (pattern by pattern insertion scatters them over the whole map).
+    *       states added later are appended until next build().
+    */
+    void update_table() {
+        std::vector<int> order;
+        order.reserve(patterns.size());
+        for (size_t i = 0; i < patterns.size(); i++) {
+            if (patterns.length(i))
+                order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [this](int a, int b) -> bool {
+            size_t la = patterns.length(a), lb = patterns.length(b);
+            int cmp = memcmp(patterns.data(a), patterns.data(b), std::min(la, lb));
+            return cmp != 0 ? cmp < 0 : la < lb;
+        });
+
+        // (pattern, state reached so far) of patterns longer than depth, in sorted order
+        std::vector<std::pair<int, int>> active;
+        active.reserve(order.size());
+        for (int i : order)
+            active.emplace_back(i, state_init);
+
+        for (size_t depth = 0; !active.empty(); depth++) {
+            size_t kept = 0;
+            for (size_t i = 0; i < active.size(); i++) {
+                int id = active[i].first;
+                int state = active[i].second;
+                int cls = classes[(unsigned char)patterns.data(id)[depth]];
+                int next = raw[state * width + cls];
+                if (next == -1) {
+                    next = new_state(state, cls);
+                    raw[state * width + cls] = next;
+                }
+                ++count[next];
+
+                // denote final state with pattern id
+                if (depth + 1 == patterns.length(id))
+                    word[next] = new_word(patterns.at(id));
+                else
+                    active[kept++] = std::make_pair(id, next);
+            }
+            active.resize(kept);
+        }
+    }
+
+    /**
+    * insert_table
     * @param: pattern; const string&
-    * build aho-corasick map using pattern
+    * insert pattern to built map, keep failure link, output link and dense map valid
+    * - follow goto while exists, grow() new state for rest of pattern
+    * - mark final state and repair output link of its failure subtree
     */
-    void update_table(const string& pattern) {
-        // iterate pattern, and make link between nodes (a single alphabet char)
-        // start at init_state
-        // follow next state if there already created(!= -1)
-        // create new node if first time
+    void insert_table(const string& pattern) {
+        int state = state_init;
         for (const auto& ch : pattern) {
-            if (raw[state][ch - CHAR_START] == -1) {
-                raw[state][ch - CHAR_START] = state_num;
-                pre_state = state;
-                pre_char = ch - CHAR_START;
-                state = state_num++;
-            } else {
-                state = raw[pre_state = state][pre_char = ch - CHAR_START];
+            int cls = classes[(unsigned char)ch];
+            int next = raw[state * width + cls];
+            if (parent[next] != state)
+                next = grow(state, cls);
+            ++count[state = next];
+        }
+
+        word[state] = new_word(pattern);
+        touch(state);
+        repair_emit(state, emit[state], state);
+    }
+
+    /**
+    * erase_table
+    * @param: pattern; const string&
+    * remove pattern from built map, it must be inserted before
+    * - unmark final state and repair output link of its failure subtree
+    * - release states nobody pass through anymore, deepest first (so always a leaf)
+    */
+    void erase_table(const string& pattern) {
+        std::vector<int> path;
+        path.reserve(pattern.length());
+
+        int state = state_init;
+        for (const auto& ch : pattern) {
+            state = raw[state * width + classes[(unsigned char)ch]];
+            path.push_back(state);
+            --count[state];
+        }
+
+        release_word(word[state]);
+        word[state] = -1;
+        touch(state);
+        repair_emit(state, state, emit[fail[state]]);
+
+        for (auto it = path.rbegin(); it != path.rend() && count[*it] == 0; ++it)
+            shrink(*it);
+    }
+
+    /**
+    * grow
+    * @param: state, ch; new state is goto(state, ch)
+    * @return: new state
+    * - new state is a leaf, so its row is same as row of its failure state
+    * - states whose transition by ch reached failure state through `state` now reach new state
+    * - states with own goto by ch stop the walk, their child gets new state as failure
+    *       if new state is longer suffix than current one.
+    */
+    int grow(int state, int ch) {
+        int next = new_state(state, ch);
+        int to = state == state_init ? state_init : raw[fail[state] * width + ch];
+
+        std::copy(raw.begin() + to * width, raw.begin() + (to + 1) * width, raw.begin() + next * width);
+        emit[next] = emit[to];
+        link(next, to);
+        raw[state * width + ch] = next;
+        touch(state);
+
+        visit(state, [&](int child) -> bool {
+            int& t = raw[child * width + ch];
+            if (parent[t] == child) {
+                if (fail[t] == to) {
+                    unlink(t);
+                    link(t, next);
+                }
+                return false;
+            }
+            t = next;
+            touch(child);
+            return true;
+        });
+        return next;
+    }
+
+    /**
+    * shrink
+    * @param: state; leaf, not final state
+    * reverse of grow(), transitions and failure links into state fall back to its failure state
+    */
+    void shrink(int state) {
+        int from = parent[state];
+        int ch = label[state];
+        int to = fail[state];
+
+        while (fchild[state] != -1) {
+            int child = fchild[state];
+            unlink(child);
+            link(child, to);
+        }
+        unlink(state);
+        raw[from * width + ch] = to;
+        touch(from);
+
+        visit(from, [&](int child) -> bool {
+            int& t = raw[child * width + ch];
+            if (t != state)
+                return false;
+            t = to;
+            touch(child);
+            return true;
+        });
+
+        parent[state] = -1;
+        free_states.push_back(state);
+    }
+
+    /**
+    * repair_emit
+    * @param: state; final state toggled
+    * @param: from, to; output link value to replace
+    * final state in failure subtree keeps itself as output link, so stop walk there.
+    */
+    void repair_emit(int state, int from, int to) {
+        emit[state] = word[state] != -1 ? state : to;
+        touch(state);
+        visit(state, [&](int child) -> bool {
+            if (word[child] != -1 || emit[child] != from)
+                return false;
+            emit[child] = to;
+            touch(child);
+            return true;
+        });
+    }
+
+    /**
+    * visit
+    * @param: state; root of failure subtree
+    * @param: func; called for each state in subtree (except root), return false to skip its subtree
+    */
+    template <typename F>
+    void visit(int state, F func) {
+        frontier.clear();
+        for (int child = fchild[state]; child != -1; child = fnext[child])
+            frontier.push_back(child);
+
+        while (!frontier.empty()) {
+            int top = frontier.back();
+            frontier.pop_back();
+            if (func(top)) {
+                for (int child = fchild[top]; child != -1; child = fnext[child])
+                    frontier.push_back(child);
             }
         }
+    }
 
-        // denote final_state in end of pattern
-        // final_state is lower than init_state and bigger than -1
-        // so, can check -1 < state < init_state to accept query
-        raw[pre_state][pre_char] = state_final;
+    // attach state to failure tree under `to`
+    void link(int state, int to) {
+        fail[state] = to;
+        touch(state);
+        fprev[state] = -1;
+        fnext[state] = fchild[to];
+        if (fchild[to] != -1)
+            fprev[fchild[to]] = state;
+        fchild[to] = state;
+    }
 
-        // swap for next state exists (this make accept a substring of an already formed pattern
-        swap(raw[state_final], raw[state]);
-        fill(raw[state].begin(), raw[state].end(), -1);
+    // detach state from failure tree
+    void unlink(int state) {
+        if (fprev[state] != -1)
+            fnext[fprev[state]] = fnext[state];
+        else
+            fchild[fail[state]] = fnext[state];
+        if (fnext[state] != -1)
+            fprev[fnext[state]] = fprev[state];
+    }
 
-        --state_num;
-        state = state_init;
-        ++state_final;
+    // make (or reuse released) state, its row is empty(-1)
+    int new_state(int from, int ch) {
+        int state;
+        if (!free_states.empty()) {
+            state = free_states.back();
+            free_states.pop_back();
+        } else {
+            state = fail.size();
+            raw.resize(raw.size() + width);
+            fail.push_back(0); word.push_back(0); emit.push_back(0);
+            parent.push_back(0); label.push_back(0); count.push_back(0);
+            fchild.push_back(0); fnext.push_back(0); fprev.push_back(0);
+        }
+
+        std::fill(raw.begin() + state * width, raw.begin() + (state + 1) * width, -1);
+        fail[state] = state_init;
+        word[state] = emit[state] = -1;
+        parent[state] = from;
+        label[state] = ch;
+        count[state] = 0;
+        fchild[state] = fnext[state] = fprev[state] = -1;
+        touch(state);
+        return state;
+    }
+
+    // make (or reuse released) pattern id
+    int new_word(const string& pattern) {
+        if (lengths.size() <= pattern.length())
+            lengths.resize(pattern.length() + 1, 0);
+        ++lengths[pattern.length()];
+        max_len = std::max(max_len, pattern.length());
+
+        if (!free_words.empty()) {
+            int id = free_words.back();
+            free_words.pop_back();
+            words[id] = pattern;
+            touch_word(id);
+            return id;
+        }
+        words.push_back(pattern);
+        touch_word(words.size() - 1);
+        return words.size() - 1;
     }
-};
\ No newline at end of file
+
+    // release pattern id, shorten max_len if it was the last longest pattern
+    void release_word(int id) {
+        --lengths[words[id].length()];
+        while (max_len > 0 && lengths[max_len] == 0)
+            --max_len;
+
+        words[id].clear();
+        free_words.push_back(id);
+        touch_word(id);
+    }
+};
+
+#endif
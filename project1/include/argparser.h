@@ -0,0 +1,102 @@
+#ifndef ARG_PARSER_H
+#define ARG_PARSER_H
+
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+
+namespace arg {
+    /*
+        arg::Parser
+
+        add argument using `argument` function with name and [description]
+
+        `parse` to parse arguments, caller then `--name=value` only
+
+        finally, `get` return value of argument with cast
+
+        `usage` lists arguments with description, print it if `parse` fails
+            (unknown `--name`, or an argument not of `--name=value` form, such as `--name value`)
+    */
+    class Parser {
+    public:
+        Parser() {
+            add("app", "caller");
+        }
+
+        // install argument to argparser with name, description
+        size_t argument(const std::string& name, const std::string& description = "") {
+            return add(name, description);
+        }
+
+        // parse arguments, false on first one that is not `--name=value` of an installed name
+        bool parse(int argc, char * argv[]) {
+            std::vector<std::string> args = std::vector<std::string>(argv, argv + argc);
+            if (args.empty())
+                return true;
+
+            values[0] = args[0];
+            for (size_t i = 1; i < args.size(); i++) {
+                const std::string& arg = args[i];
+                size_t eq = arg.find('=');
+                if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+                    return false;
+                try {
+                    values[index(arg.substr(2, eq - 2))] = arg.substr(eq + 1);
+                } catch (std::out_of_range& e) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // one line per argument after caller, `--name=value: description`
+        std::string usage() const {
+            std::vector<std::string> names(values.size());
+            for (const auto& entry : indicies)
+                names[entry.second] = entry.first;
+            std::string text = "usage: " + (values[0].empty() ? std::string("app") : values[0]) + " [--name=value ...]\n";
+            for (size_t i = 1; i < names.size(); i++)
+                text += "  --" + names[i] + "=value: " + descriptions[i] + "\n";
+            return text;
+        }
+
+        // get value and type cast using stringstream
+        template <typename T>
+        T get(const std::string& name, T option = 0) {
+            T value = option;
+            try {
+                std::string v = values[index(name)];
+                if (!v.empty()) {
+                    std::stringstream ss(v);
+                    ss >> value;
+                } else throw std::out_of_range("key not initialized");
+            } catch (std::out_of_range& e) {
+                return option;
+            }
+            return value;
+        }
+
+    private:
+        std::unordered_map<std::string, size_t> indicies;
+        std::vector<std::string> descriptions;
+        std::vector<std::string> values;
+
+        size_t add(const std::string& name, const std::string& description) {
+            indicies[name] = values.size();
+            values.emplace_back();
+            descriptions.emplace_back(description);
+            return indicies[name];
+        }
+
+        size_t index(const std::string& name) {
+            if (indicies.find(name) == indicies.end()) throw std::out_of_range("key not exist");
+            return indicies.at(name);
+        }
+    };
+}
+
+#endif
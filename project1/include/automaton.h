@@ -0,0 +1,582 @@
+#ifndef AUTOMATON_H
+#define AUTOMATON_H
+
+#include <vector>
+#include <string>
+#include <list>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+#include <prefilter.h>
+#include <engine.h>
+
+// every byte can appear in pattern and query, bytes are mapped to equivalence classes
+#define ALPHABET_SIZE (256)
+
+// class id of a byte, 0 for bytes no pattern uses; ids run up to ALPHABET_SIZE once every byte is used,
+// one more than a byte holds, so a narrower type would wrap the last class to 0
+typedef uint16_t ClassId;
+static_assert((1u << (8 * sizeof(ClassId))) > ALPHABET_SIZE, "ClassId must hold class id ALPHABET_SIZE");
+
+// states, pattern ids are stored in segments of this many, unchanged segments are shared by versions
+#define STATE_SHIFT (6)
+#define STATE_SEGMENT (1 << STATE_SHIFT)
+#define STATE_MASK (STATE_SEGMENT - 1)
+#define WORD_SHIFT (10)
+#define WORD_SEGMENT (1 << WORD_SHIFT)
+#define WORD_MASK (WORD_SEGMENT - 1)
+// dense map of fewer states is stored as uint16_t (raw16), half the cache footprint of int
+#define NARROW_STATES (1 << 16)
+
+/**
+* Automaton
+* immutable version of aho-corasick map, built and published by Table
+* readers hold it by shared_ptr, it's released when last reader drops it.
+* - classes: byte to equivalence class, bytes never in any pattern share class 0
+* - prefilter: skip query bytes no pattern starts with, while walk is at root
+* - raw: dense map, raw[state * width + class] is next state (goto or failure already resolved)
+*       raw16 instead if `narrow` (fewer than NARROW_STATES states), walk is specialized on its index type
+* - bits, base, child: sparse map, only goto edges, failure links are followed on miss
+*       bits has a bit per class of each state, child[base[state] + rank of bit] is goto state
+* - fail: failure link, longest proper suffix of state which is also in trie
+* - word: pattern id accepted at state, -1 if not final state
+* - emit: output link, nearest final state on failure chain (including itself), -1 if none
+* - engine: matcher of scan(), map is always there for Stream and next versions
+*/
+class Automaton {
+public:
+    // (start position, pattern id) of a match
+    typedef std::pair<size_t, int> Hit;
+
+    /**
+    * Layout
+    * - DENSE: row of width per state, one load per byte
+    * - SPARSE: bitmap and goto edges only, about 1/4 of dense memory on a-z, slower on failure chase
+    */
+    enum Layout { DENSE, SPARSE };
+
+    /**
+    * Engine
+    * matcher of scan(), chosen by Table for each version from shape of pattern set
+    * - AUTO: only asked of Table (Options), never of a version
+    * - AUTOMATON: walk map of layout, one transition per byte
+    * - MEMMEM: search each pattern on its own (Memmem), a handful of patterns
+    * - RABIN_KARP: hash lookup of window per distinct length (RabinKarp), many short patterns
+    *       whose map is too large for cache
+    */
+    enum Engine { AUTO, AUTOMATON, MEMMEM, RABIN_KARP };
+
+    struct Segment {
+        std::vector<int> raw, fail, word, emit;
+        std::vector<uint16_t> raw16;
+        std::vector<uint64_t> bits;
+        std::vector<int> base, child;
+    };
+
+    // patterns of a word segment back to back, pattern i is bytes[offsets[i], offsets[i + 1])
+    struct Words {
+        std::vector<uint64_t> offsets;
+        std::string bytes;
+    };
+
+    // bytes of a pattern, valid while Automaton is
+    struct Pattern {
+        const char* data;
+        size_t length;
+
+        std::string str() const { return std::string(data, length); }
+    };
+
+    size_t version = 0;
+    int state_init = 0;
+    size_t max_len = 0;
+    int width = 1;
+    ClassId classes[ALPHABET_SIZE] = {};
+    Prefilter prefilter;
+    Layout layout = DENSE;
+    Engine engine = AUTOMATON;
+    // dense map is raw16, chosen by Table on publish from number of states
+    bool narrow = false;
+    // patterns of MEMMEM, RABIN_KARP engine, nullptr otherwise
+    std::shared_ptr<const Memmem> needles;
+    std::shared_ptr<const RabinKarp> hashes;
+    // 64 bit blocks of bits per state, number of states (including released)
+    int blocks = 1;
+    size_t states = 0;
+
+    // owners of segments, nullptr if segment is a view of `storage` (mapped image or huge page block)
+    // storage_bytes: memory held by storage, 0 if it's a mapped file
+    std::vector<std::shared_ptr<const Segment>> segments;
+    std::vector<std::shared_ptr<const Words>> words;
+    std::shared_ptr<const void> storage;
+    size_t storage_bytes = 0;
+
+    // attach segment (or word segment), keep plain pointers for lookup
+    void attach(const std::shared_ptr<const Segment>& segment) {
+        segments.push_back(segment);
+        raw.push_back(segment->raw.data());
+        raw16.push_back(segment->raw16.data());
+        fail.push_back(segment->fail.data());
+        word.push_back(segment->word.data());
+        emit.push_back(segment->emit.data());
+        bits.push_back(segment->bits.data());
+        base.push_back(segment->base.data());
+        child.push_back(segment->child.data());
+    }
+
+    void attach(const std::shared_ptr<const Words>& segment) {
+        words.push_back(segment);
+        offsets.push_back(segment->offsets.data());
+        bytes.push_back(segment->bytes.data());
+    }
+
+    // attach segment owned by `storage`
+    void attach(const int* raw_, const uint16_t* raw16_, const int* fail_, const int* word_, const int* emit_,
+                const uint64_t* bits_, const int* base_, const int* child_) {
+        segments.push_back(nullptr);
+        raw.push_back(raw_);
+        raw16.push_back(raw16_);
+        fail.push_back(fail_);
+        word.push_back(word_);
+        emit.push_back(emit_);
+        bits.push_back(bits_);
+        base.push_back(base_);
+        child.push_back(child_);
+    }
+
+    void attach(const uint64_t* offsets_, const char* bytes_) {
+        words.push_back(nullptr);
+        offsets.push_back(offsets_);
+        bytes.push_back(bytes_);
+    }
+
+    // attach i-th segment (or word segment) of previous version, unchanged since then
+    void share(const Automaton& prev, size_t i) {
+        segments.push_back(prev.segments[i]);
+        raw.push_back(prev.raw[i]);
+        raw16.push_back(prev.raw16[i]);
+        fail.push_back(prev.fail[i]);
+        word.push_back(prev.word[i]);
+        emit.push_back(prev.emit[i]);
+        bits.push_back(prev.bits[i]);
+        base.push_back(prev.base[i]);
+        child.push_back(prev.child[i]);
+        storage = prev.storage;
+        storage_bytes = prev.storage_bytes;
+    }
+
+    void share_words(const Automaton& prev, size_t i) {
+        words.push_back(prev.words[i]);
+        offsets.push_back(prev.offsets[i]);
+        bytes.push_back(prev.bytes[i]);
+        storage = prev.storage;
+        storage_bytes = prev.storage_bytes;
+    }
+
+    int next(int state, char ch) const {
+        if (layout == SPARSE)
+            return step<SPARSE, int>(state, ch);
+        return narrow ? step<DENSE, uint16_t>(state, ch) : step<DENSE, int>(state, ch);
+    }
+
+    int output(int state) const {
+        return emit[state >> STATE_SHIFT][state & STATE_MASK];
+    }
+
+    int failure(int state) const {
+        return fail[state >> STATE_SHIFT][state & STATE_MASK];
+    }
+
+    int accept(int state) const {
+        return word[state >> STATE_SHIFT][state & STATE_MASK];
+    }
+
+    Pattern pattern(int id) const {
+        const uint64_t* offset = offsets[id >> WORD_SHIFT] + (id & WORD_MASK);
+        return Pattern{bytes[id >> WORD_SHIFT] + offset[0], size_t(offset[1] - offset[0])};
+    }
+
+    size_t pattern_length(int id) const {
+        const uint64_t* offset = offsets[id >> WORD_SHIFT] + (id & WORD_MASK);
+        return offset[1] - offset[0];
+    }
+
+    // upper bound of pattern id
+    size_t word_size() const {
+        return words.size() * WORD_SEGMENT;
+    }
+
+    // length of the longest pattern, ranges of scan() must overlap by this - 1
+    size_t max_length() const {
+        return max_len;
+    }
+
+    // bytes held by map of this version (shared segments included), patterns and mapped image excluded
+    size_t memory() const {
+        size_t bytes = sizeof(Automaton) + storage_bytes;
+        for (const auto& segment : segments) {
+            if (!segment)
+                continue;
+            bytes += sizeof(Segment);
+            bytes += (segment->raw.capacity() + segment->fail.capacity() + segment->word.capacity()
+                + segment->emit.capacity() + segment->base.capacity() + segment->child.capacity()) * sizeof(int);
+            bytes += segment->bits.capacity() * sizeof(uint64_t) + segment->raw16.capacity() * sizeof(uint16_t);
+        }
+        if (needles)
+            bytes += needles->memory();
+        if (hashes)
+            bytes += hashes->memory();
+        return bytes;
+    }
+
+    /**
+    * Matches
+    * caller-owned result buffer, reuse it for every query so matching allocates nothing
+    * once it has grown to the pattern set and hit count.
+    * - hits: (first start position, pattern id) of each matched pattern, sorted by first occurrence
+    * - epochs: per pattern id, the query (epoch) which reported it last, so dedup is one compare
+    * - counts: per pattern id, occurrences in this query, kept only if `counting` (valid for ids in hits)
+    * - visited: states walked by scan(), bytes prefilter skipped are not walked (0 for other engines)
+    */
+    struct Matches {
+        std::vector<Hit> hits;
+        std::vector<unsigned> epochs;
+        unsigned epoch = 0;
+        std::vector<size_t> counts;
+        bool counting = false;
+        size_t visited = 0;
+
+        // start next query, stale epochs are cleared when counter wraps around
+        void reset(size_t words) {
+            hits.clear();
+            visited = 0;
+            if (epochs.size() < words)
+                epochs.resize(words, 0);
+            if (counting && counts.size() < words)
+                counts.resize(words, 0);
+            if (++epoch == 0) {
+                std::fill(epochs.begin(), epochs.end(), 0);
+                epoch = 1;
+            }
+        }
+
+        // occurrence of pattern id at start, first one is kept in hits, Count if counting
+        template <bool Count>
+        void report(size_t start, int id) {
+            if (mark(id)) {
+                hits.emplace_back(start, id);
+                if (Count)
+                    counts[id] = 1;
+            } else if (Count) {
+                ++counts[id];
+            }
+        }
+
+        // mark pattern id as reported, return false if it's already reported in this query
+        bool mark(int id) {
+            if (epochs[id] == epoch)
+                return false;
+            epochs[id] = epoch;
+            return true;
+        }
+    };
+
+    // (pattern id, start of first occurrence, occurrences or 0 if not counted) of a matched pattern
+    struct Match {
+        int id;
+        size_t offset;
+        size_t count;
+    };
+
+    /**
+    * find matched patterns with position in input query, in one scan
+    * @param: query, length; query bytes
+    * @param: matches; Matches&, result buffer, its `counting` decides whether occurrences are counted
+    * @param: result; std::vector<Match>&, overwritten, in order of first occurrence
+    * ids are of this version, pattern(id) is its bytes
+    */
+    void locate(const char* query, size_t length, Matches& matches, std::vector<Match>& result) const {
+        scan(query, length, 0, length, matches);
+        result.clear();
+        result.reserve(matches.hits.size());
+        for (const auto& hit : matches.hits)
+            result.push_back(Match{hit.second, hit.first, matches.counting ? matches.counts[hit.second] : 0});
+    }
+
+    std::vector<Match> locate(const std::string& query, bool count = false) const {
+        Matches matches;
+        matches.counting = count;
+        std::vector<Match> result;
+        locate(query.data(), query.length(), matches, result);
+        return result;
+    }
+
+    /**
+    * find matched patterns in input query
+    * @param: query; const string&
+    * @return: matched pattern list, it's already unique.
+    * @see scan()
+    */
+    std::list<std::string> search(const std::string& query) const {
+        Matches matches;
+        scan(query, 0, query.length(), matches);
+
+        std::list<std::string> result;
+        for (const auto& hit : matches.hits) {
+            result.push_back(pattern(hit.second).str());
+        }
+        return result;
+    }
+
+    /**
+    * scan part of query
+    * @param: query, length; query bytes, need not be terminated (may point in input buffer)
+    * @param: begin, end; only matches start in [begin, end) are reported
+    * @param: matches; Matches&, result buffer, previous result is dropped
+    * - walk map once from begin, one transition per input char (sparse one may chase failure links)
+    *       walk stops at end + max_length() - 1, where last reported match can end
+    *       at root, jump to next byte some pattern starts with (Prefilter), no match starts in between
+    * - follow output links of each state to collect every pattern ends here
+    * MEMMEM, RABIN_KARP engines find same matches by searching patterns instead of walking map
+    * queries can be split into ranges and scanned concurrently, @see merge()
+    */
+    void scan(const char* query, size_t length, size_t begin, size_t end, Matches& matches) const {
+        if (engine != AUTOMATON && matches.counting)
+            lookup<true>(query, length, begin, end, matches);
+        else if (engine != AUTOMATON)
+            lookup<false>(query, length, begin, end, matches);
+        else if (layout == SPARSE && matches.counting)
+            walk<SPARSE, true, int>(query, length, begin, end, matches);
+        else if (layout == SPARSE)
+            walk<SPARSE, false, int>(query, length, begin, end, matches);
+        else if (narrow && matches.counting)
+            walk<DENSE, true, uint16_t>(query, length, begin, end, matches);
+        else if (narrow)
+            walk<DENSE, false, uint16_t>(query, length, begin, end, matches);
+        else if (matches.counting)
+            walk<DENSE, true, int>(query, length, begin, end, matches);
+        else
+            walk<DENSE, false, int>(query, length, begin, end, matches);
+
+        // patterns share a start position only if one is prefix of other, so shorter comes first
+        std::sort(matches.hits.begin(), matches.hits.end(), [this](const Hit& a, const Hit& b) {
+            return a.first != b.first ? a.first < b.first : pattern_length(a.second) < pattern_length(b.second);
+        });
+    }
+
+    void scan(const std::string& query, size_t begin, size_t end, Matches& matches) const {
+        scan(query.data(), query.length(), begin, end, matches);
+    }
+
+    /**
+    * merge scan() results of consecutive ranges of a query
+    * @param: parts, size; scan() results in order of range
+    * @param: matches; Matches&, pattern is reported once at its first range (so first occurrence)
+    *       if counting (parts must count too), occurrences of ranges are summed, ranges own disjoint starts
+    */
+    void merge(const Matches* parts, size_t size, Matches& matches) const {
+        matches.reset(word_size());
+        for (size_t part = 0; part < size; part++) {
+            matches.visited += parts[part].visited;
+            for (const auto& hit : parts[part].hits) {
+                if (matches.mark(hit.second)) {
+                    matches.hits.push_back(hit);
+                    if (matches.counting)
+                        matches.counts[hit.second] = parts[part].counts[hit.second];
+                } else if (matches.counting) {
+                    matches.counts[hit.second] += parts[part].counts[hit.second];
+                }
+            }
+        }
+    }
+
+    /**
+    * Stream
+    * match a query given in fragments, walk state carries over so matches spanning fragments are found
+    * - always walks map, whatever engine of version is
+    * - holds the version it started on, every fragment is matched against it
+    * - each pattern is reported once, when its first occurrence completes,
+    *       start position counts from beginning of stream
+    */
+    class Stream {
+    public:
+        // count: also count occurrences of each pattern, see Matches::counts
+        explicit Stream(std::shared_ptr<const Automaton> automaton, bool count = false)
+            : automaton(std::move(automaton)) {
+            found.counting = count;
+            reset();
+        }
+
+        // start next stream on same version
+        void reset() {
+            state = automaton->state_init;
+            offset = 0;
+            found.reset(automaton->word_size());
+        }
+
+        /**
+        * feed next fragment
+        * @param: data, size; bytes of fragment, need not outlive call
+        * @return: number of new matches, they are appended to matches().hits in order they complete
+        */
+        size_t feed(const char* data, size_t size) {
+            size_t before = found.hits.size();
+            if (automaton->layout == SPARSE)
+                advance<SPARSE, int>(data, size);
+            else if (automaton->narrow)
+                advance<DENSE, uint16_t>(data, size);
+            else
+                advance<DENSE, int>(data, size);
+            offset += size;
+            return found.hits.size() - before;
+        }
+
+        /**
+        * end of query, sort matches as scan() does (by first occurrence)
+        * @return: const Matches&, valid until reset()
+        */
+        const Matches& finish() {
+            const Automaton* a = automaton.get();
+            std::sort(found.hits.begin(), found.hits.end(), [a](const Hit& x, const Hit& y) {
+                return x.first != y.first ? x.first < y.first : a->pattern_length(x.second) < a->pattern_length(y.second);
+            });
+            return found;
+        }
+
+        const Matches& matches() const {
+            return found;
+        }
+
+        // bytes fed since reset()
+        size_t position() const {
+            return offset;
+        }
+
+        const Automaton& version() const {
+            return *automaton;
+        }
+
+    private:
+        std::shared_ptr<const Automaton> automaton;
+        int state = 0;
+        size_t offset = 0;
+        Matches found;
+
+        template <Layout L, typename T>
+        void advance(const char* data, size_t size) {
+            const Automaton& a = *automaton;
+            bool skip = a.prefilter.active();
+            for (size_t pos = 0; pos < size; pos++) {
+                if (skip && state == a.state_init) {
+                    pos = a.prefilter.find(data, pos, size);
+                    if (pos >= size)
+                        break;
+                }
+                state = a.step<L, T>(state, data[pos]);
+                for (int out = a.output(state); out != -1; out = a.output(a.failure(out))) {
+                    int id = a.accept(out);
+                    if (found.counting)
+                        found.report<true>(offset + pos + 1 - a.pattern_length(id), id);
+                    else
+                        found.report<false>(offset + pos + 1 - a.pattern_length(id), id);
+                }
+            }
+        }
+    };
+
+private:
+    std::vector<const int*> raw, fail, word, emit;
+    std::vector<const uint16_t*> raw16;
+    std::vector<const uint64_t*> bits;
+    std::vector<const int*> base, child;
+    std::vector<const uint64_t*> offsets;
+    std::vector<const char*> bytes;
+
+    // rows of dense map of index type T (int: raw, uint16_t: raw16)
+    template <typename T>
+    const T* rows(int segment) const;
+
+    // transition of layout, sparse one follows failure links until some state has goto by ch
+    template <Layout L, typename T>
+    int step(int state, char ch) const {
+        int cls = classes[(unsigned char)ch];
+        if (L == DENSE)
+            return rows<T>(state >> STATE_SHIFT)[(state & STATE_MASK) * width + cls];
+
+        if (cls == 0)
+            return state_init;
+        for (;;) {
+            int segment = state >> STATE_SHIFT;
+            int index = state & STATE_MASK;
+            const uint64_t* row = bits[segment] + index * blocks;
+            uint64_t bit = uint64_t(1) << (cls & 63);
+            if (row[cls >> 6] & bit) {
+                int rank = __builtin_popcountll(row[cls >> 6] & (bit - 1));
+                for (int i = 0; i < (cls >> 6); i++)
+                    rank += __builtin_popcountll(row[i]);
+                return child[segment][base[segment][index] + rank];
+            }
+            if (state == state_init)
+                return state_init;
+            state = failure(state);
+        }
+    }
+
+    // scan() of MEMMEM, RABIN_KARP engines, every occurrence is reported (Count) or first one of each pattern
+    template <bool Count>
+    void lookup(const char* query, size_t length, size_t begin, size_t end, Matches& matches) const {
+        matches.reset(word_size());
+        auto report = [&matches](size_t start, int id) {
+            matches.report<Count>(start, id);
+        };
+        if (engine == MEMMEM)
+            needles->scan(query, length, begin, end, Count, report);
+        else
+            hashes->scan(query, length, begin, end, report);
+    }
+
+    // walk of scan(), matches are in order found
+    template <Layout L, bool Count, typename T>
+    void walk(const char* query, size_t length, size_t begin, size_t end, Matches& matches) const {
+        matches.reset(word_size());
+
+        size_t stop = std::min(length, end + std::max<size_t>(max_len, 1) - 1);
+        int state = state_init;
+        // at root, next match must start at or after pos, so nothing left once past end
+        size_t last = std::min(stop, end);
+        bool skip = prefilter.active();
+        // walked bytes are counted by what prefilter skipped, nothing is added per byte
+        size_t pos = begin, skipped = 0;
+        for (; pos < stop; pos++) {
+            if (skip && state == state_init) {
+                size_t from = pos;
+                pos = prefilter.find(query, pos, last);
+                skipped += pos - from;
+                if (pos >= last)
+                    break;
+            }
+            state = step<L, T>(state, query[pos]);
+            for (int out = output(state); out != -1; out = output(failure(out))) {
+                int id = accept(out);
+                size_t start = pos + 1 - pattern_length(id);
+                if (start < end)
+                    matches.report<Count>(start, id);
+            }
+        }
+        if (pos > begin)
+            matches.visited = std::min(pos, stop) - begin - skipped;
+    }
+};
+
+template <>
+inline const int* Automaton::rows<int>(int segment) const {
+    return raw[segment];
+}
+
+template <>
+inline const uint16_t* Automaton::rows<uint16_t>(int segment) const {
+    return raw16[segment];
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <list>
+#include <algorithm>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+#include <automaton.h>
+
+// shards of Cache, a lock each, so concurrent readers rarely share one
+#define CACHE_SHARDS (16)
+// largest entry is this fraction of a shard, longer queries are not cached
+#define CACHE_ENTRY_SHARE (4)
+
+/**
+* Cache
+* bounded cache of query results (hits of scan()), keyed by hash of query bytes.
+* - query is kept in entry and compared on lookup, so a hash collision is a miss, never a wrong result
+* - entry is tagged with version it was matched on, lookup on another version misses
+*       entries of older versions are dropped lazily: by lookup of their key on a newer version, or by eviction,
+*       so a publish costs nothing here however large cache is
+* - least recently used entries of a shard are evicted while it is over its share of capacity
+* - sharded by hash with a mutex per shard, safe for concurrent readers
+*/
+class Cache {
+public:
+    typedef Automaton::Hit Hit;
+
+    /**
+    * Stats
+    * - hits, misses: lookups, inserts: entries put, evictions: dropped for capacity,
+    *       expired: entries of older versions dropped (by lookup, or instead of an eviction)
+    * - entries, bytes: current size, bytes count queries, hits and bookkeeping of entries
+    */
+    struct Stats {
+        size_t hits = 0, misses = 0, inserts = 0, evictions = 0, expired = 0;
+        size_t entries = 0, bytes = 0;
+
+        double hit_rate() const {
+            return hits + misses ? double(hits) / (hits + misses) : 0.0;
+        }
+    };
+
+    // capacity: bytes of all entries
+    explicit Cache(size_t capacity) : shards(CACHE_SHARDS) {
+        for (auto& shard : shards)
+            shard.capacity = capacity / CACHE_SHARDS;
+    }
+
+    // 8 bytes at a time, hashing must stay far cheaper than scanning the query
+    static uint64_t hash(const char* data, size_t size) {
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ (size * 0xC2B2AE3D27D4EB4FULL);
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (h ^ mix(word)) * 0x9FB21C651E98DF25ULL;
+        }
+        if (i < size) {
+            uint64_t word = 0;
+            memcpy(&word, data + i, size - i);
+            h = (h ^ mix(word)) * 0x9FB21C651E98DF25ULL;
+        }
+        return mix(h);
+    }
+
+    /**
+    * find result of query on version
+    * @param: version; version query is matched on
+    * @param: key; hash() of query
+    * @param: query, size; query bytes
+    * @param: hits; vector<Hit>&, overwritten with cached result on hit
+    * @return: true on hit
+    */
+    bool get(size_t version, uint64_t key, const char* query, size_t size, std::vector<Hit>& hits) {
+        Shard& shard = at(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.version = std::max(shard.version, version);
+        auto found = shard.index.find(key);
+        if (found != shard.index.end() && found->second->version < shard.version) {
+            drop(shard, found->second);
+            ++shard.stats.expired;
+            found = shard.index.end();
+        }
+        if (found == shard.index.end() || found->second->version != version
+            || found->second->query.size() != size || memcmp(found->second->query.data(), query, size) != 0) {
+            ++shard.stats.misses;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        hits = found->second->hits;
+        ++shard.stats.hits;
+        return true;
+    }
+
+    /**
+    * keep result of query on version, replaces entry of same key
+    * results of a version older than newest one seen by shard are stale and not kept
+    */
+    void put(size_t version, uint64_t key, const char* query, size_t size, const std::vector<Hit>& hits) {
+        Shard& shard = at(key);
+        size_t bytes = cost(size, hits.size());
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.version = std::max(shard.version, version);
+        if (version < shard.version || bytes > shard.capacity / CACHE_ENTRY_SHARE)
+            return;
+
+        auto found = shard.index.find(key);
+        if (found != shard.index.end())
+            drop(shard, found->second);
+        shard.lru.push_front(Entry{key, version, std::string(query, size), hits});
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += bytes;
+        ++shard.stats.inserts;
+        while (shard.bytes > shard.capacity) {
+            auto last = std::prev(shard.lru.end());
+            if (last->version < shard.version)
+                ++shard.stats.expired;
+            else
+                ++shard.stats.evictions;
+            drop(shard, last);
+        }
+    }
+
+    Stats stats() {
+        Stats total;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total.hits += shard.stats.hits;
+            total.misses += shard.stats.misses;
+            total.inserts += shard.stats.inserts;
+            total.evictions += shard.stats.evictions;
+            total.expired += shard.stats.expired;
+            total.entries += shard.index.size();
+            total.bytes += shard.bytes;
+        }
+        return total;
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        size_t version;
+        std::string query;
+        std::vector<Hit> hits;
+    };
+
+    // lru: most recent first, index: key to its entry
+    // version: newest version looked up or put, entries before it are stale
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        size_t capacity = 0;
+        size_t bytes = 0;
+        size_t version = 0;
+        Stats stats;
+    };
+
+    std::vector<Shard> shards;
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xFF51AFD7ED558CCDULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    Shard& at(uint64_t key) {
+        return shards[key % CACHE_SHARDS];
+    }
+
+    // entry and its list, index nodes
+    static size_t cost(size_t size, size_t hits) {
+        return sizeof(Entry) + 4 * sizeof(void*) + size + hits * sizeof(Hit);
+    }
+
+    void drop(Shard& shard, std::list<Entry>::iterator entry) {
+        shard.bytes -= cost(entry->query.size(), entry->hits.size());
+        shard.index.erase(entry->key);
+        shard.lru.erase(entry);
+    }
+};
+
+#endif
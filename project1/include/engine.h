@@ -0,0 +1,302 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ENGINE_X86
+#endif
+
+// RabinKarp keys windows up to this many bytes by their bytes, longer ones by rolling hash
+#define ENGINE_PACKED (8)
+
+/**
+* Memmem
+* matcher of a handful of patterns, search each one on its own over the query.
+* compare first and last byte of pattern at 16 (32) positions at once,
+* memcmp the middle only where both match, so most blocks cost two compares per pattern.
+* AVX2 is used if cpu supports it, memchr on first byte for 1 byte patterns or not x86
+*/
+class Memmem {
+public:
+    void add(const char* data, size_t length, int id) {
+        needles.push_back(Needle{std::string(data, length), id});
+    }
+
+    size_t size() const {
+        return needles.size();
+    }
+
+    size_t memory() const {
+        size_t bytes = sizeof(Memmem) + needles.capacity() * sizeof(Needle);
+        for (const auto& needle : needles)
+            bytes += needle.bytes.capacity();
+        return bytes;
+    }
+
+    /**
+    * find occurrences of patterns
+    * @param: query, length; query bytes
+    * @param: begin, end; only occurrences start in [begin, end) are reported
+    * @param: all; report every occurrence, otherwise first one of each pattern
+    * @param: report; report(start, id), in order of pattern then start
+    */
+    template <typename Report>
+    void scan(const char* query, size_t length, size_t begin, size_t end, bool all, Report report) const {
+        for (const auto& needle : needles) {
+            size_t size = needle.bytes.size();
+            if (size > length)
+                continue;
+            size_t last = std::min(end, length - size + 1);
+            for (size_t pos = find(query, length, begin, last, needle.bytes); pos < last;
+                 pos = find(query, length, pos + 1, last, needle.bytes)) {
+                report(pos, needle.id);
+                if (!all)
+                    break;
+            }
+        }
+    }
+
+private:
+    struct Needle {
+        std::string bytes;
+        int id;
+    };
+    std::vector<Needle> needles;
+
+    // first start in [pos, last) where needle occurs, last if none
+    static size_t find(const char* query, size_t length, size_t pos, size_t last, const std::string& needle) {
+#ifdef ENGINE_X86
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (needle.size() > 1)
+            pos = avx2 ? find_avx2(query, length, pos, last, needle) : find_sse2(query, length, pos, last, needle);
+#endif
+        return find_scalar(query, pos, last, needle);
+    }
+
+    static size_t find_scalar(const char* query, size_t pos, size_t last, const std::string& needle) {
+        const char* data = needle.data();
+        size_t size = needle.size();
+        while (pos < last) {
+            const void* found = memchr(query + pos, data[0], last - pos);
+            if (!found)
+                return last;
+            pos = static_cast<const char*>(found) - query;
+            if (memcmp(query + pos + 1, data + 1, size - 1) == 0)
+                return pos;
+            ++pos;
+        }
+        return last;
+    }
+
+#ifdef ENGINE_X86
+    // vector search stops at a match, or where block would read past query (scalar one goes on from there)
+    static size_t find_sse2(const char* query, size_t length, size_t pos, size_t last, const std::string& needle) {
+        size_t size = needle.size();
+        __m128i first = _mm_set1_epi8(needle[0]);
+        __m128i tail = _mm_set1_epi8(needle[size - 1]);
+        for (; pos < last && pos + size - 1 + 16 <= length; pos += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query + pos));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query + pos + size - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, tail)));
+            for (; mask; mask &= mask - 1) {
+                size_t at = pos + __builtin_ctz(mask);
+                if (at >= last)
+                    return last;
+                if (memcmp(query + at + 1, needle.data() + 1, size - 2) == 0)
+                    return at;
+            }
+        }
+        return std::min(pos, last);
+    }
+
+    __attribute__((target("avx2")))
+    static size_t find_avx2(const char* query, size_t length, size_t pos, size_t last, const std::string& needle) {
+        size_t size = needle.size();
+        __m256i first = _mm256_set1_epi8(needle[0]);
+        __m256i tail = _mm256_set1_epi8(needle[size - 1]);
+        for (; pos < last && pos + size - 1 + 32 <= length; pos += 32) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + pos));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + pos + size - 1));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, tail)));
+            for (; mask; mask &= mask - 1) {
+                size_t at = pos + __builtin_ctz(mask);
+                if (at >= last)
+                    return last;
+                if (memcmp(query + at + 1, needle.data() + 1, size - 2) == 0)
+                    return at;
+            }
+        }
+        return std::min(pos, last);
+    }
+#endif
+};
+
+/**
+* RabinKarp
+* matcher of many short patterns, hash table of patterns per distinct length,
+* window of each length is looked up at every query position.
+* - up to ENGINE_PACKED bytes the window itself is the key (exact, no verify)
+* - longer windows are rolling polynomial hashes, candidates are verified with memcmp
+* a pass per distinct length, but a few probes into small tables instead of a load per byte
+* into a map too large for cache.
+*/
+class RabinKarp {
+public:
+    void add(const char* data, size_t length, int id) {
+        size_t i = 0;
+        while (i < tables.size() && tables[i].length != length)
+            ++i;
+        if (i == tables.size()) {
+            tables.push_back(Table());
+            tables.back().length = length;
+            tables.back().power = power(length);
+        }
+        tables[i].entries.push_back(Entry{key(data, length), bytes.size(), id});
+        bytes.append(data, length);
+    }
+
+    // index tables once every pattern is added
+    void build() {
+        for (auto& table : tables) {
+            size_t size = 16;
+            while (size < table.entries.size() * 2)
+                size <<= 1;
+            table.shift = 64 - __builtin_ctzll(size);
+            table.slots.assign(size, -1);
+            for (size_t i = 0; i < table.entries.size(); i++) {
+                size_t slot = table.slot(table.entries[i].key);
+                while (table.slots[slot] != -1)
+                    slot = (slot + 1) & (size - 1);
+                table.slots[slot] = i;
+            }
+        }
+        std::sort(tables.begin(), tables.end(), [](const Table& a, const Table& b) {
+            return a.length < b.length;
+        });
+    }
+
+    // number of distinct pattern lengths, each is one pass over query
+    size_t lengths() const {
+        return tables.size();
+    }
+
+    size_t memory() const {
+        size_t total = sizeof(RabinKarp) + bytes.capacity() + tables.capacity() * sizeof(Table);
+        for (const auto& table : tables)
+            total += table.entries.capacity() * sizeof(Entry) + table.slots.capacity() * sizeof(int);
+        return total;
+    }
+
+    /**
+    * find occurrences of patterns
+    * @param: query, length; query bytes
+    * @param: begin, end; only occurrences start in [begin, end) are reported
+    * @param: report; report(start, id) of every occurrence, in order of length then start
+    */
+    template <typename Report>
+    void scan(const char* query, size_t length, size_t begin, size_t end, Report report) const {
+        for (const auto& table : tables) {
+            size_t size = table.length;
+            if (size > length)
+                break;
+            size_t last = std::min(end, length - size + 1);
+            if (begin >= last)
+                continue;
+            size_t mask = table.slots.size() - 1;
+
+            if (size <= ENGINE_PACKED) {
+                uint64_t bits = size == 8 ? ~uint64_t(0) : (uint64_t(1) << (size * 8)) - 1;
+                for (size_t pos = begin; pos < last; pos++) {
+                    uint64_t window;
+                    if (pos + 8 <= length) {
+                        memcpy(&window, query + pos, 8);
+                        window &= bits;
+                    } else {
+                        window = pack(query + pos, size);
+                    }
+                    for (size_t slot = table.slot(window); table.slots[slot] != -1; slot = (slot + 1) & mask) {
+                        const Entry& entry = table.entries[table.slots[slot]];
+                        if (entry.key == window) {
+                            report(pos, entry.id);
+                            break;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            uint64_t hash = roll(query + begin, size);
+            for (size_t pos = begin;; pos++) {
+                for (size_t slot = table.slot(hash); table.slots[slot] != -1; slot = (slot + 1) & mask) {
+                    const Entry& entry = table.entries[table.slots[slot]];
+                    if (entry.key == hash && memcmp(query + pos, bytes.data() + entry.offset, size) == 0)
+                        report(pos, entry.id);
+                }
+                if (pos + 1 >= last)
+                    break;
+                hash = hash * BASE + (unsigned char)query[pos + size] - table.power * (unsigned char)query[pos];
+            }
+        }
+    }
+
+private:
+    // odd multiplier, arithmetic is mod 2^64
+    static const uint64_t BASE = 1099511628211ULL;
+
+    // key: packed bytes or hash, offset: pattern in `bytes`
+    struct Entry {
+        uint64_t key;
+        size_t offset;
+        int id;
+    };
+
+    // open addressing (linear probe) on entries of one length, slots are entry index or -1
+    struct Table {
+        size_t length = 0;
+        uint64_t power = 1;
+        int shift = 60;
+        std::vector<Entry> entries;
+        std::vector<int> slots;
+
+        size_t slot(uint64_t key) const {
+            return (key * 0x9E3779B97F4A7C15ULL) >> shift;
+        }
+    };
+
+    std::vector<Table> tables;
+    std::string bytes;
+
+    static uint64_t pack(const char* data, size_t length) {
+        uint64_t key = 0;
+        memcpy(&key, data, length);
+        return key;
+    }
+
+    static uint64_t roll(const char* data, size_t length) {
+        uint64_t hash = 0;
+        for (size_t i = 0; i < length; i++)
+            hash = hash * BASE + (unsigned char)data[i];
+        return hash;
+    }
+
+    // BASE^length, weight of byte leaving window
+    static uint64_t power(size_t length) {
+        uint64_t result = 1;
+        for (size_t i = 0; i < length; i++)
+            result *= BASE;
+        return result;
+    }
+
+    static uint64_t key(const char* data, size_t length) {
+        return length <= ENGINE_PACKED ? pack(data, length) : roll(data, length);
+    }
+};
+
+#endif
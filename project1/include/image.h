@@ -0,0 +1,342 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include <automaton.h>
+
+// on-disk format of compiled Table, bump IMAGE_VERSION on any layout change
+#define IMAGE_MAGIC ("ACIMAGE")
+#define IMAGE_VERSION (3)
+#define IMAGE_ORDER (0x01020304u)
+// sections start at this alignment, so mapped arrays are aligned as in memory
+#define IMAGE_ALIGN (64)
+// huge page size of image::Block (x86-64 transparent huge page)
+#define IMAGE_HUGE_PAGE (1 << 21)
+
+namespace image {
+    /*
+        sections of image, arrays of builder (Table) and reader (Automaton)
+        - RAW ... FPREV: per state, same as Table members
+        - RAW16: RAW as uint16_t if map is narrow (Automaton::narrow), empty otherwise
+        - BITS, BASE, CHILD: sparse map, segment after segment, CHILD_OFFSETS is first child of each segment
+        - WORD_OFFSETS, WORD_BYTES: pattern id i is WORD_BYTES[WORD_OFFSETS[i], WORD_OFFSETS[i + 1])
+    */
+    enum Section {
+        RAW, RAW16, FAIL, WORD, EMIT,
+        BITS, BASE, CHILD, CHILD_OFFSETS,
+        WORD_OFFSETS, WORD_BYTES,
+        PARENT, LABEL, COUNT, FCHILD, FNEXT, FPREV,
+        FREE_STATES, FREE_WORDS, LENGTHS,
+        SECTIONS
+    };
+
+    /*
+        image::Header
+
+        first bytes of image, every position is an offset from start of file (position independent)
+
+        `digest` is hash of pattern set image was built from, caller checks it against its input
+        `checksum` is hash of header (checksum as 0) and every section, set by Writer::write,
+            Mapping of a file whose bytes do not match it is not valid (corrupt file is rebuilt, never read)
+            0 in images only held in memory (Block, shared segment), which never pass through a file
+    */
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t order;
+        uint32_t layout;
+        int32_t width;
+        int32_t state_init;
+        int32_t blocks;
+        uint64_t max_len;
+        uint64_t states;
+        uint64_t words;
+        uint64_t digest;
+        uint64_t checksum;
+        ClassId classes[ALPHABET_SIZE];
+        unsigned char starts[ALPHABET_SIZE];
+        uint64_t offset[SECTIONS];
+        uint64_t size[SECTIONS];
+    };
+
+    // 8 bytes at a time in 4 independent lanes (multiplies overlap), continues `h` so sections hash in turn
+    inline uint64_t hash(uint64_t h, const void* data, size_t size) {
+        const uint64_t M = 0x9FB21C651E98DF25ULL;
+        const char* p = static_cast<const char*>(data);
+        uint64_t lanes[4] = {h, h + 1, h + 2, h + 3};
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            for (int k = 0; k < 4; k++) {
+                uint64_t word;
+                memcpy(&word, p + i + 8 * k, 8);
+                lanes[k] = (lanes[k] ^ word) * M;
+                lanes[k] ^= lanes[k] >> 29;
+            }
+        }
+        h = lanes[0];
+        for (int k = 1; k < 4; k++)
+            h = (h ^ lanes[k]) * M;
+        for (; i < size; i += 8) {
+            uint64_t word = 0;
+            memcpy(&word, p + i, std::min<size_t>(8, size - i));
+            h = (h ^ word) * M;
+            h ^= h >> 29;
+        }
+        return h ^ size;
+    }
+
+    // see Header::checksum, `sections` are data of each section (in memory of writer or in image)
+    inline uint64_t checksum(const Header& header, const void* const* sections) {
+        Header copy = header;
+        copy.checksum = 0;
+        uint64_t h = hash(0x9E3779B97F4A7C15ULL, &copy, sizeof(copy));
+        for (int i = 0; i < SECTIONS; i++)
+            h = hash(h, sections[i], header.size[i]);
+        return h;
+    }
+
+    /*
+        image::Writer
+
+        `add` section (bytes are copied only on `write`, so keep them alive until then)
+
+        `write` to temporary file and rename it, readers never see half written image
+    */
+    class Writer {
+    public:
+        Writer() {
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+            header.version = IMAGE_VERSION;
+            header.order = IMAGE_ORDER;
+        }
+
+        Header header;
+
+        template <typename T>
+        void add(Section section, const T* data, size_t count) {
+            sections[section] = std::make_pair(static_cast<const void*>(data), count * sizeof(T));
+        }
+
+        template <typename T>
+        void add(Section section, const std::vector<T>& data) {
+            add(section, data.data(), data.size());
+        }
+
+        // place sections, @return: bytes of image
+        uint64_t layout() {
+            uint64_t position = align(sizeof(Header));
+            for (int i = 0; i < SECTIONS; i++) {
+                header.offset[i] = position;
+                header.size[i] = sections[i].second;
+                position = align(position + sections[i].second);
+            }
+            return position;
+        }
+
+        // copy image to memory of layout() bytes
+        void copy(char* to) {
+            layout();
+            memcpy(to, &header, sizeof(header));
+            for (int i = 0; i < SECTIONS; i++) {
+                if (sections[i].second)
+                    memcpy(to + header.offset[i], sections[i].first, sections[i].second);
+            }
+        }
+
+        bool write(const std::string& path) {
+            layout();
+            const void* data[SECTIONS];
+            for (int i = 0; i < SECTIONS; i++)
+                data[i] = sections[i].first;
+            header.checksum = checksum(header, data);
+            std::string temporary = path + ".tmp";
+            int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return false;
+
+            bool ok = put(fd, &header, sizeof(header), sizeof(header));
+            for (int i = 0; ok && i < SECTIONS; i++)
+                ok = pad(fd, header.offset[i]) && put(fd, sections[i].first, sections[i].second, header.offset[i] + sections[i].second);
+            ok = ok && fsync(fd) == 0;
+            ok = close(fd) == 0 && ok;
+            if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+                unlink(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        std::pair<const void*, size_t> sections[SECTIONS] = {};
+        uint64_t written = 0;
+
+        static uint64_t align(uint64_t position) {
+            return (position + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+        }
+
+        bool put(int fd, const void* data, size_t size, uint64_t end) {
+            const char* p = static_cast<const char*>(data);
+            while (size) {
+                ssize_t bytes = ::write(fd, p, size);
+                if (bytes < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                p += bytes;
+                size -= bytes;
+            }
+            written = end;
+            return true;
+        }
+
+        bool pad(int fd, uint64_t position) {
+            static const char zero[IMAGE_ALIGN] = {};
+            return put(fd, zero, position - written, position);
+        }
+    };
+
+    /*
+        image::View
+
+        image in memory, `valid` if header and every section are in it
+
+        `section` is typed pointer into image, `count` its number of elements
+    */
+    class View {
+    public:
+        View() = default;
+        View(const View&) = delete;
+        View& operator=(const View&) = delete;
+
+        bool valid() const {
+            if (!base || length < sizeof(Header))
+                return false;
+            const Header& h = header();
+            if (memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic)) != 0 || h.version != IMAGE_VERSION || h.order != IMAGE_ORDER)
+                return false;
+            for (int i = 0; i < SECTIONS; i++) {
+                if (h.offset[i] % IMAGE_ALIGN || h.offset[i] > length || h.size[i] > length - h.offset[i])
+                    return false;
+            }
+            return true;
+        }
+
+        const Header& header() const {
+            return *reinterpret_cast<const Header*>(base);
+        }
+
+        template <typename T>
+        const T* section(Section section) const {
+            return reinterpret_cast<const T*>(base + header().offset[section]);
+        }
+
+        template <typename T>
+        size_t count(Section section) const {
+            return header().size[section] / sizeof(T);
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        const char* data() const {
+            return base;
+        }
+
+    protected:
+        const char* base = nullptr;
+        size_t length = 0;
+    };
+
+    /*
+        image::Mapping
+
+        map image file read-only and shared, so processes loading same image share its page cache
+        every byte is read once to check Header::checksum, a file that fails it is unmapped (not valid),
+        so a flipped state or class id never reaches a walk
+    */
+    class Mapping : public View {
+    public:
+        Mapping(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+                void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED) {
+                    base = static_cast<const char*>(map);
+                    length = st.st_size;
+                }
+            }
+            close(fd);
+            if (valid() && !intact()) {
+                munmap(const_cast<char*>(base), length);
+                base = nullptr;
+                length = 0;
+            }
+        }
+
+        ~Mapping() {
+            if (base)
+                munmap(const_cast<char*>(base), length);
+        }
+
+    private:
+        bool intact() const {
+            const void* data[SECTIONS];
+            for (int i = 0; i < SECTIONS; i++)
+                data[i] = base + header().offset[i];
+            return checksum(header(), data) == header().checksum;
+        }
+    };
+
+    /*
+        image::Block
+
+        anonymous memory holding image of `writer`, aligned and advised to be backed by huge pages
+        (one TLB entry per IMAGE_HUGE_PAGE instead of per 4KiB page), falls back to normal pages
+    */
+    class Block : public View {
+    public:
+        Block(Writer& writer) {
+            size_t size = (writer.layout() + IMAGE_HUGE_PAGE - 1) / IMAGE_HUGE_PAGE * IMAGE_HUGE_PAGE;
+            // over-allocate to align start to huge page, then trim
+            void* map = mmap(NULL, size + IMAGE_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (map == MAP_FAILED)
+                return;
+            char* begin = static_cast<char*>(map);
+            char* aligned = begin + (IMAGE_HUGE_PAGE - uintptr_t(begin) % IMAGE_HUGE_PAGE) % IMAGE_HUGE_PAGE;
+            if (aligned != begin)
+                munmap(begin, aligned - begin);
+            if (aligned + size != begin + size + IMAGE_HUGE_PAGE)
+                munmap(aligned + size, begin + size + IMAGE_HUGE_PAGE - (aligned + size));
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+            writer.copy(aligned);
+            base = aligned;
+            length = size;
+        }
+
+        ~Block() {
+            if (base)
+                munmap(const_cast<char*>(base), length);
+        }
+    };
+}
+
+#endif
@@ -11,6 +11,8 @@
 #include <future>
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <cstdint>
 
 namespace Thread {
     namespace Safe {
@@ -67,17 +69,119 @@ namespace Thread {
         };
     }
 
+    /**
+    * Deque
+    * Chase-Lev work-stealing deque of pointers (Le et al.), fences of paper are folded into seq_cst accesses
+    * - owner thread push, take at bottom (LIFO)
+    * - other threads steal at top (FIFO), lock-free, one CAS per steal
+    * - array grows on demand, old arrays are kept until destruction since thieves may still read them
+    */
+    template <typename T>
+    class Deque {
+    public:
+        Deque(size_t capacity = 256) : top(0), bottom(0) {
+            arrays.emplace_back(new Array(capacity));
+            array.store(arrays.back().get(), std::memory_order_relaxed);
+        }
+
+        // owner only
+        void push(T item) {
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            int64_t t = top.load(std::memory_order_acquire);
+            Array* a = array.load(std::memory_order_relaxed);
+            if (b - t > int64_t(a->capacity) - 1) {
+                arrays.emplace_back(a->grow(b, t));
+                a = arrays.back().get();
+                array.store(a, std::memory_order_release);
+            }
+            a->put(b, item);
+            // seq_cst, not release: Pool::wake() reads sleepers right after push (store-load order)
+            bottom.store(b + 1, std::memory_order_seq_cst);
+        }
+
+        // owner only, nullptr if empty
+        T take() {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Array* a = array.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_seq_cst);
+
+            T item = nullptr;
+            if (t <= b) {
+                item = a->get(b);
+                if (t == b) {
+                    // last one, race with thieves
+                    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                        item = nullptr;
+                    bottom.store(b + 1, std::memory_order_relaxed);
+                }
+            } else {
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return item;
+        }
+
+        // any thread, nullptr if empty or lost race
+        T steal() {
+            int64_t t = top.load(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_seq_cst);
+            if (t >= b)
+                return nullptr;
+
+            Array* a = array.load(std::memory_order_acquire);
+            T item = a->get(t);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;
+            return item;
+        }
+
+        bool empty() const {
+            return bottom.load(std::memory_order_seq_cst) <= top.load(std::memory_order_seq_cst);
+        }
+
+    private:
+        struct Array {
+            size_t capacity;
+            std::unique_ptr<std::atomic<T>[]> items;
+
+            Array(size_t capacity) : capacity(capacity), items(new std::atomic<T>[capacity]) {}
+
+            T get(int64_t i) const { return items[i & (capacity - 1)].load(std::memory_order_relaxed); }
+            void put(int64_t i, T item) { items[i & (capacity - 1)].store(item, std::memory_order_relaxed); }
+
+            Array* grow(int64_t b, int64_t t) const {
+                Array* next = new Array(capacity * 2);
+                for (int64_t i = t; i < b; i++)
+                    next->put(i, get(i));
+                return next;
+            }
+        };
+
+        std::atomic<int64_t> top, bottom;
+        std::atomic<Array*> array;
+        std::vector<std::unique_ptr<Array>> arrays;
+    };
+
+    /**
+    * Pool
+    * work-stealing thread pool
+    * - each worker has its own Deque, tasks pushed by a worker go to its deque
+    * - tasks pushed by other threads go to injection stack (lock-free, Treiber),
+    *       a worker takes whole stack at once (exchange, so no ABA) and moves it to its deque
+    * - idle worker steals from others, then parks. push takes the park mutex only
+    *       if some worker is parked, so busy pool never locks on push.
+    */
     class Pool {
     public:
         Pool(size_t);
         ~Pool();
+
+        // wait until every pushed task is done
         void wait() {
-            {
-                std::unique_lock<std::mutex> lock(qutex);
-                cond.wait(lock, [this]() -> bool {
-                    return tasks.empty();
-                });
-            }
+            std::unique_lock<std::mutex> lock(qutex);
+            idle.wait(lock, [this]() -> bool {
+                return pending.load() == 0;
+            });
         }
 
         size_t size() { return _size; }
@@ -86,33 +190,153 @@ namespace Thread {
         auto push(F&& f, Args&&... args) 
             -> std::future<typename std::result_of<F(Args...)>::type>;
     private:
-        std::vector<std::thread> workers;
-        std::queue<std::function<void()>> tasks;    
+        struct Task {
+            std::function<void()> run;
+            Task* next;
+        };
+
+        struct Worker {
+            Pool* pool;
+            size_t index;
+            Deque<Task*> deque;
+            unsigned seed;
+        };
+
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<Task*> injection;
+        std::atomic<size_t> pending;
+        std::atomic<int> sleepers;
+        std::atomic<unsigned> epoch;
+        std::atomic<bool> stop;
         std::mutex qutex;
-        std::condition_variable cond;
+        std::condition_variable cond, idle;
         size_t _size;
-        bool stop;
+
+        // worker of calling thread, nullptr if not a worker of any pool
+        static Worker*& current() {
+            static thread_local Worker* worker = nullptr;
+            return worker;
+        }
+
+        void run(Worker* worker);
+        Task* find(Worker* worker);
+        bool ready() const;
+        void enqueue(Task* task);
+        void wake();
     };
-     
-    inline Pool::Pool(size_t size) : _size(size), stop(false) {
+
+    inline Pool::Pool(size_t size)
+        : injection(nullptr), pending(0), sleepers(0), epoch(0), stop(false), _size(size) {
+        for (size_t i = 0; i < size; ++i) {
+            workers.emplace_back(new Worker());
+            workers.back()->pool = this;
+            workers.back()->index = i;
+            workers.back()->seed = unsigned(i) * 2654435761u + 1;
+        }
         for (size_t i = 0; i < size; ++i)
-            workers.emplace_back([this]() {
-                    for(;;) {
-                        std::function<void()> task;
-                        {
-                            std::unique_lock<std::mutex> lock(this->qutex);
-                            this->cond.wait(lock, [this]() -> bool {
-                                return this->stop || !this->tasks.empty();
-                            });
-                            if (this->stop && this->tasks.empty())
-                                return;
-                            task = std::move(this->tasks.front());
-                            this->tasks.pop();
-                        }
-                        task();
-                    }
+            threads.emplace_back([this, i]() { run(workers[i].get()); });
+    }
+
+    inline void Pool::run(Worker* worker) {
+        current() = worker;
+        for (;;) {
+            Task* task = find(worker);
+            if (task) {
+                task->run();
+                delete task;
+                if (--pending == 0) {
+                    std::unique_lock<std::mutex> lock(qutex);
+                    idle.notify_all();
                 }
-            );
+                continue;
+            }
+
+            if (stop.load())
+                return;
+
+            // park, announce first then check again, so push either sees sleeper or we see its task
+            unsigned seen = epoch.load();
+            ++sleepers;
+            if (ready() || stop.load()) {
+                --sleepers;
+                continue;
+            }
+            {
+                std::unique_lock<std::mutex> lock(qutex);
+                cond.wait(lock, [this, seen]() -> bool {
+                    return stop.load() || epoch.load() != seen;
+                });
+            }
+            --sleepers;
+        }
+    }
+
+    // own deque, then injection stack, then steal from others starting at random victim
+    inline Pool::Task* Pool::find(Worker* worker) {
+        Task* task = worker->deque.take();
+        if (task)
+            return task;
+
+        Task* head = injection.exchange(nullptr);
+        if (head) {
+            // stack is newest first, keep oldest to run and push the rest,
+            // so next oldest is at bottom of deque (taken first), newest ones are stolen first
+            while (head->next) {
+                Task* next = head->next;
+                worker->deque.push(head);
+                head = next;
+            }
+            if (!worker->deque.empty())
+                wake();
+            return head;
+        }
+
+        worker->seed = worker->seed * 1103515245u + 12345u;
+        size_t start = worker->seed >> 8;
+        for (size_t i = 0; i < _size; ++i) {
+            Worker* victim = workers[(start + i) % _size].get();
+            if (victim == worker)
+                continue;
+            task = victim->deque.steal();
+            if (task)
+                return task;
+        }
+        return nullptr;
+    }
+
+    inline bool Pool::ready() const {
+        if (injection.load() != nullptr)
+            return true;
+        for (const auto& worker : workers) {
+            if (!worker->deque.empty())
+                return true;
+        }
+        return false;
+    }
+
+    inline void Pool::enqueue(Task* task) {
+        ++pending;
+        Worker* worker = current();
+        if (worker && worker->pool == this) {
+            worker->deque.push(task);
+        } else {
+            task->next = injection.load(std::memory_order_relaxed);
+            while (!injection.compare_exchange_weak(task->next, task))
+                ;
+        }
+        wake();
+    }
+
+    // wake one parked worker, if any
+    inline void Pool::wake() {
+        if (sleepers.load() == 0)
+            return;
+        {
+            std::unique_lock<std::mutex> lock(qutex);
+            ++epoch;
+        }
+        cond.notify_one();
     }
 
     template <class F, class... Args>
@@ -125,13 +349,9 @@ namespace Thread {
         );
             
         std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(qutex);
-            tasks.emplace([task]() {
-                (*task)();
-            });
-        }
-        cond.notify_one();
+        enqueue(new Task{[task]() {
+            (*task)();
+        }, nullptr});
         return res;
     }
 
@@ -141,8 +361,8 @@ namespace Thread {
             stop = true;
         }
         cond.notify_all();
-        for (auto& worker: workers)
-            worker.join();
+        for (auto& thread: threads)
+            thread.join();
     }
 }
 
@@ -0,0 +1,146 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREFILTER_X86
+#endif
+
+// most distinct first bytes to skip with vector compares, over this most bytes are candidates anyway
+#define PREFILTER_NEEDLES (8)
+
+/**
+* Prefilter
+* find next position where some pattern can start, automaton walks from root only there.
+* chosen by number of distinct first bytes of pattern set, when it's rebuilt
+* - EMPTY: no pattern, nothing can match
+* - MEMCHR: one first byte
+* - SSE2, AVX2: up to PREFILTER_NEEDLES first bytes, compare 16 (32) bytes at once
+*       AVX2 is used if cpu supports it, SSE2 is baseline of x86-64
+* - SCALAR: up to PREFILTER_NEEDLES first bytes, not x86
+* - NONE: too many first bytes, walking automaton is as fast as skipping
+*/
+class Prefilter {
+public:
+    enum Kind { NONE, EMPTY, MEMCHR, SCALAR, SSE2, AVX2 };
+
+    Kind kind = NONE;
+
+    /**
+    * choose prefilter for set of first bytes
+    * @param: starts; bool[256], starts[byte] if some pattern starts with byte
+    */
+    void build(const bool* starts) {
+        count = 0;
+        for (int ch = 0; ch < 256; ch++) {
+            table[ch] = starts[ch];
+            if (starts[ch] && count < PREFILTER_NEEDLES)
+                needles[count] = (unsigned char)ch;
+            count += starts[ch];
+        }
+
+        if (count == 0)
+            kind = EMPTY;
+        else if (count == 1)
+            kind = MEMCHR;
+        else if (count > PREFILTER_NEEDLES)
+            kind = NONE;
+        else
+            kind = vector_kind();
+    }
+
+    // prefilter skips anything, otherwise find() is identity
+    bool active() const {
+        return kind != NONE;
+    }
+
+    /**
+    * find next candidate start position
+    * @param: query; bytes
+    * @param: pos, end; range to search
+    * @return: first position in [pos, end) where some pattern starts with its byte, end if none
+    */
+    size_t find(const char* query, size_t pos, size_t end) const {
+        switch (kind) {
+        case NONE:
+            return pos;
+        case EMPTY:
+            return end;
+        case MEMCHR: {
+            const void* found = memchr(query + pos, needles[0], end - pos);
+            return found ? static_cast<const char*>(found) - query : end;
+        }
+#ifdef PREFILTER_X86
+        case SSE2:
+            return find_sse2(query, pos, end);
+        case AVX2:
+            return find_avx2(query, pos, end);
+#endif
+        default:
+            return find_scalar(query, pos, end);
+        }
+    }
+
+private:
+    bool table[256] = {};
+    unsigned char needles[PREFILTER_NEEDLES] = {};
+    int count = 0;
+
+    static Kind vector_kind() {
+#ifdef PREFILTER_X86
+        static const Kind kind = __builtin_cpu_supports("avx2") ? AVX2 : SSE2;
+        return kind;
+#else
+        return SCALAR;
+#endif
+    }
+
+    size_t find_scalar(const char* query, size_t pos, size_t end) const {
+        while (pos < end && !table[(unsigned char)query[pos]])
+            ++pos;
+        return pos;
+    }
+
+#ifdef PREFILTER_X86
+    size_t find_sse2(const char* query, size_t pos, size_t end) const {
+        __m128i keys[PREFILTER_NEEDLES];
+        for (int i = 0; i < count; i++)
+            keys[i] = _mm_set1_epi8((char)needles[i]);
+
+        for (; pos + 16 <= end; pos += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query + pos));
+            __m128i hit = _mm_cmpeq_epi8(block, keys[0]);
+            for (int i = 1; i < count; i++)
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, keys[i]));
+            int mask = _mm_movemask_epi8(hit);
+            if (mask)
+                return pos + __builtin_ctz(mask);
+        }
+        return find_scalar(query, pos, end);
+    }
+
+    __attribute__((target("avx2")))
+    size_t find_avx2(const char* query, size_t pos, size_t end) const {
+        __m256i keys[PREFILTER_NEEDLES];
+        for (int i = 0; i < count; i++)
+            keys[i] = _mm256_set1_epi8((char)needles[i]);
+
+        for (; pos + 32 <= end; pos += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + pos));
+            __m256i hit = _mm256_cmpeq_epi8(block, keys[0]);
+            for (int i = 1; i < count; i++)
+                hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(block, keys[i]));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+            if (mask)
+                return pos + __builtin_ctz(mask);
+        }
+        return find_scalar(query, pos, end);
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include <image.h>
+
+// control segment format, bump SHARED_VERSION on any layout change
+#define SHARED_MAGIC ("ACSHARE")
+#define SHARED_VERSION (1)
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "sequence of control segment is read by other processes, it must be lock free");
+
+namespace shared {
+    /*
+        shared::Control
+
+        version header of a shared map, POSIX shared memory segment `name`
+
+        map of sequence s is image segment `name.s`, publisher writes it whole, then stores s (release),
+        so a reader loading s (acquire) finds it complete. 0: nothing published yet.
+        sequence only grows, a restarted publisher goes on from last one, so readers never miss a version
+    */
+    struct Control {
+        char magic[8];
+        uint32_t version;
+        uint32_t order;
+        std::atomic<uint64_t> sequence;
+    };
+
+    // shm_open name, one leading slash
+    inline std::string path(const std::string& name) {
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+    }
+
+    inline std::string path(const std::string& name, uint64_t sequence) {
+        return path(name) + "." + std::to_string(sequence);
+    }
+
+    /*
+        shared::Segment
+
+        image in shared memory, mapped read-only by readers, read-write by publisher which fills it
+        mapping stays valid after segment is unlinked, so versions in use outlive their name
+    */
+    class Segment : public image::View {
+    public:
+        // map existing segment read-only
+        explicit Segment(const std::string& path) {
+            int fd = shm_open(path.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+                return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(image::Header)) {
+                void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED) {
+                    base = static_cast<const char*>(map);
+                    length = st.st_size;
+                }
+            }
+            close(fd);
+        }
+
+        // create segment of image of `writer`, replacing any stale one of same name
+        Segment(const std::string& path, image::Writer& writer) {
+            char* map = create(path, writer.layout());
+            if (map)
+                writer.copy(map);
+        }
+
+        // create segment holding a copy of image `view` (opened image file)
+        Segment(const std::string& path, const image::View& view) {
+            char* map = create(path, view.size());
+            if (map)
+                memcpy(map, view.data(), view.size());
+        }
+
+        ~Segment() {
+            if (base)
+                munmap(const_cast<char*>(base), length);
+        }
+
+    private:
+        char* create(const std::string& path, size_t size) {
+            shm_unlink(path.c_str());
+            int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0)
+                return nullptr;
+            void* map = MAP_FAILED;
+            if (ftruncate(fd, size) == 0)
+                map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED) {
+                shm_unlink(path.c_str());
+                return nullptr;
+            }
+            base = static_cast<const char*>(map);
+            length = size;
+            return static_cast<char*>(map);
+        }
+    };
+
+    /*
+        shared::Publisher
+
+        owner of shared map `name`, one per name on a host: holds an exclusive flock on control segment
+        while alive, so a second publisher of the name is not valid (it would race on sequence)
+        lock goes with the process, a publisher that crashed does not keep the name
+
+        `publish` image as next sequence and unlink previous one, readers still mapping it keep it
+        latest one is unlinked on destruction, control segment is kept for next publisher
+    */
+    class Publisher {
+    public:
+        explicit Publisher(const std::string& name) : name(name) {
+            fd = shm_open(path(name).c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0)
+                return;
+            // lock before touching control, it may be another publisher's
+            void* map = MAP_FAILED;
+            if (flock(fd, LOCK_EX | LOCK_NB) == 0 && ftruncate(fd, sizeof(Control)) == 0)
+                map = mmap(NULL, sizeof(Control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                held = errno == EWOULDBLOCK;
+                close(fd);
+                fd = -1;
+                return;
+            }
+            control = static_cast<Control*>(map);
+            // new segment is zero filled, stale one of another format starts over
+            if (memcmp(control->magic, SHARED_MAGIC, sizeof(control->magic)) != 0
+                || control->version != SHARED_VERSION || control->order != IMAGE_ORDER) {
+                control->sequence.store(0);
+                memcpy(control->magic, SHARED_MAGIC, sizeof(control->magic));
+                control->version = SHARED_VERSION;
+                control->order = IMAGE_ORDER;
+            }
+        }
+
+        Publisher(const Publisher&) = delete;
+        Publisher& operator=(const Publisher&) = delete;
+
+        ~Publisher() {
+            if (!control)
+                return;
+            uint64_t last = control->sequence.load();
+            if (last)
+                shm_unlink(path(name, last).c_str());
+            munmap(control, sizeof(Control));
+            // closing releases lock
+            close(fd);
+        }
+
+        bool valid() const {
+            return control != nullptr;
+        }
+
+        // not valid because another publisher holds name
+        bool busy() const {
+            return held;
+        }
+
+        /**
+        * write image to segment of next sequence and switch readers to it
+        * @param: source; image::Writer& of map, or image::View of an image to copy
+        * @return: segment view (read-write mapping of publisher), nullptr if it could not be created
+        */
+        template <typename Source>
+        std::shared_ptr<const image::View> publish(Source& source) {
+            if (!control)
+                return nullptr;
+            uint64_t previous = control->sequence.load();
+            std::shared_ptr<const image::View> segment = std::make_shared<const Segment>(path(name, previous + 1), source);
+            if (!segment->valid())
+                return nullptr;
+            control->sequence.store(previous + 1, std::memory_order_release);
+            if (previous)
+                shm_unlink(path(name, previous).c_str());
+            return segment;
+        }
+
+    private:
+        std::string name;
+        int fd = -1;
+        bool held = false;
+        Control* control = nullptr;
+    };
+
+    /*
+        shared::Subscriber
+
+        reader of shared map `name`, control segment is mapped read-only
+
+        `sequence` is one load from shared page, cheap enough to check before every query
+        `open` segment of a sequence, nullptr if publisher has unlinked it meanwhile (load sequence again)
+    */
+    class Subscriber {
+    public:
+        explicit Subscriber(const std::string& name) : name(name) {
+            int fd = shm_open(path(name).c_str(), O_RDONLY, 0);
+            if (fd < 0)
+                return;
+            struct stat st;
+            void* map = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Control))
+                map = mmap(NULL, sizeof(Control), PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED)
+                return;
+            control = static_cast<const Control*>(map);
+            if (memcmp(control->magic, SHARED_MAGIC, sizeof(control->magic)) != 0
+                || control->version != SHARED_VERSION || control->order != IMAGE_ORDER) {
+                munmap(const_cast<Control*>(control), sizeof(Control));
+                control = nullptr;
+            }
+        }
+
+        Subscriber(const Subscriber&) = delete;
+        Subscriber& operator=(const Subscriber&) = delete;
+
+        ~Subscriber() {
+            if (control)
+                munmap(const_cast<Control*>(control), sizeof(Control));
+        }
+
+        bool valid() const {
+            return control != nullptr;
+        }
+
+        uint64_t sequence() const {
+            return control ? control->sequence.load(std::memory_order_acquire) : 0;
+        }
+
+        std::shared_ptr<const image::View> open(uint64_t sequence) const {
+            std::shared_ptr<const image::View> segment = std::make_shared<const Segment>(path(name, sequence));
+            return segment->valid() ? segment : nullptr;
+        }
+
+    private:
+        std::string name;
+        const Control* control = nullptr;
+    };
+}
+
+#endif
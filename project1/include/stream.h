@@ -0,0 +1,230 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+
+// size of read block, and of output kept before write
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+namespace io {
+    // view of bytes in input buffer, valid until next Reader::fill()
+    struct Slice {
+        const char* data;
+        size_t size;
+    };
+
+    /*
+        io::Reader
+
+        read fd in large blocks (or mmap it if regular file), parse commands in place
+
+        `command` parse next complete line in buffer, return false if there is no more buffered
+
+        `fill` read next block, slices given before are invalid after it (buffer is compacted)
+    */
+    class Reader {
+    public:
+        Reader(int fd, size_t capacity = STREAM_BUFFER_SIZE) : fd(fd) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map != MAP_FAILED) {
+                    madvise(map, st.st_size, MADV_SEQUENTIAL);
+                    mapped = static_cast<const char*>(map);
+                    data = mapped;
+                    len = st.st_size;
+                    eof = true;
+                    return;
+                }
+            }
+            buffer.resize(capacity);
+            data = buffer.data();
+        }
+
+        ~Reader() {
+            if (mapped)
+                munmap(const_cast<char*>(mapped), len);
+        }
+
+        /**
+        * parse next command, `C query\n`
+        * @param: cmd; char&, command character
+        * @param: query; Slice&, rest of line after one separator
+        * @return: false if no complete line is buffered, fill() and try again
+        */
+        bool command(char& cmd, Slice& query) {
+            while (pos < len && isspace(data[pos]))
+                ++pos;
+            if (pos == len)
+                return false;
+
+            const char* begin = data + pos;
+            const char* newline = static_cast<const char*>(memchr(begin, '\n', len - pos));
+            if (!newline && !eof)
+                return false;
+            const char* end = newline ? newline : data + len;
+
+            cmd = *begin++;
+            if (begin < end && *begin == ' ')
+                ++begin;
+            query.data = begin;
+            query.size = end - begin;
+            pos = newline ? newline - data + 1 : len;
+            return true;
+        }
+
+        /**
+        * take incomplete line of command which fills most of buffer, instead of growing buffer for it
+        * @param: cmd; char, command character line must start with
+        * @param: part; Slice&, rest of line buffered so far, it's consumed
+        * @return: false if line is short enough to wait for (or input ended), use command()
+        * call rest() after each fill() for the remaining bytes of line.
+        */
+        bool split(char cmd, Slice& part) {
+            if (eof || len - pos < buffer.size() / 2 || data[pos] != cmd || memchr(data + pos, '\n', len - pos))
+                return false;
+
+            const char* begin = data + pos + 1;
+            if (*begin == ' ')
+                ++begin;
+            part.data = begin;
+            part.size = data + len - begin;
+            pos = len;
+            return true;
+        }
+
+        /**
+        * take next bytes of line split() began
+        * @param: part; Slice&, bytes up to newline (or every buffered byte), consumed
+        * @return: true if line ends here
+        */
+        bool rest(Slice& part) {
+            const char* begin = data + pos;
+            const char* newline = static_cast<const char*>(memchr(begin, '\n', len - pos));
+            part.data = begin;
+            part.size = (newline ? newline : data + len) - begin;
+            pos = newline ? newline - data + 1 : len;
+            return newline || eof;
+        }
+
+        /**
+        * read next whitespace separated token, fill() as needed
+        * @param: token; string&, overwritten
+        * @return: false if input ends before any token
+        */
+        bool token(std::string& token) {
+            token.clear();
+            for (;;) {
+                while (pos < len && isspace(data[pos])) {
+                    if (!token.empty())
+                        return true;
+                    ++pos;
+                }
+                size_t begin = pos;
+                while (pos < len && !isspace(data[pos]))
+                    ++pos;
+                token.append(data + begin, pos - begin);
+                if (pos < len)
+                    return true;
+                if (!fill())
+                    return !token.empty();
+            }
+        }
+
+        /**
+        * read next block, keep unparsed bytes at front of buffer (grow it if a line is longer)
+        * @return: false if input already ended
+        */
+        bool fill() {
+            if (eof)
+                return false;
+
+            len -= pos;
+            memmove(&buffer[0], &buffer[pos], len);
+            pos = 0;
+            if (len == buffer.size())
+                buffer.resize(buffer.size() * 2);
+            data = buffer.data();
+
+            for (;;) {
+                ssize_t bytes = read(fd, &buffer[len], buffer.size() - len);
+                if (bytes < 0 && errno == EINTR)
+                    continue;
+                if (bytes <= 0)
+                    eof = true;
+                else
+                    len += bytes;
+                return true;
+            }
+        }
+
+    private:
+        int fd;
+        std::vector<char> buffer;
+        const char* mapped = nullptr;
+        const char* data = nullptr;
+        size_t len = 0;
+        size_t pos = 0;
+        bool eof = false;
+
+        static bool isspace(char ch) {
+            return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+        }
+    };
+
+    /*
+        io::Writer
+
+        append output to `buffer()`, `spill` writes it once it grows over capacity
+
+        `flush` before waiting for more input, peer may wait for output of what it sent
+    */
+    class Writer {
+    public:
+        Writer(int fd, size_t capacity = STREAM_BUFFER_SIZE) : fd(fd), capacity(capacity) {
+            out.reserve(capacity * 2);
+        }
+
+        ~Writer() {
+            flush();
+        }
+
+        std::string& buffer() {
+            return out;
+        }
+
+        void spill() {
+            if (out.size() >= capacity)
+                flush();
+        }
+
+        void flush() {
+            const char* p = out.data();
+            const char* end = p + out.size();
+            while (p != end) {
+                ssize_t bytes = write(fd, p, end - p);
+                if (bytes < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+                p += bytes;
+            }
+            out.clear();
+        }
+
+    private:
+        int fd;
+        size_t capacity;
+        std::string out;
+    };
+}
+
+#endif
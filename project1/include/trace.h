@@ -0,0 +1,152 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// sub-buckets per power of two of Histogram, a percentile is at most 1 / TRACE_SUB_BUCKETS (about 3%) above value,
+// as precise as marker's histogram (SUB_BITS 5)
+#define TRACE_SUB_SHIFT (5)
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_SHIFT)
+#define TRACE_BUCKETS (64 * TRACE_SUB_BUCKETS)
+
+/**
+* Histogram
+* log-linear buckets of values (nanoseconds, counts), a power of two split in TRACE_SUB_BUCKETS
+* relaxed atomics, so any thread records and dump reads while others record
+*/
+class Histogram {
+public:
+    void record(uint64_t value) {
+        buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t top = highest.load(std::memory_order_relaxed);
+        while (value > top && !highest.compare_exchange_weak(top, value, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    double mean() const {
+        uint64_t n = count();
+        return n ? double(sum.load(std::memory_order_relaxed)) / n : 0.0;
+    }
+
+    uint64_t max() const {
+        return highest.load(std::memory_order_relaxed);
+    }
+
+    // upper bound of bucket holding p-th value, 0 if empty
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (!n)
+            return 0;
+        uint64_t rank = uint64_t(p * (n - 1)) + 1, seen = 0;
+        for (int i = 0; i < TRACE_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(upper(i), max());
+        }
+        return max();
+    }
+
+private:
+    std::atomic<uint64_t> buckets[TRACE_BUCKETS] = {};
+    std::atomic<uint64_t> total{0}, sum{0}, highest{0};
+
+    // values below TRACE_SUB_BUCKETS have a bucket each, then TRACE_SUB_BUCKETS per power of two
+    static int index(uint64_t value) {
+        if (value < TRACE_SUB_BUCKETS)
+            return int(value);
+        int bits = 63 - __builtin_clzll(value);
+        int sub = int(value >> (bits - TRACE_SUB_SHIFT)) & (TRACE_SUB_BUCKETS - 1);
+        return (bits - TRACE_SUB_SHIFT + 1) * TRACE_SUB_BUCKETS + sub;
+    }
+
+    static uint64_t upper(int i) {
+        if (i < TRACE_SUB_BUCKETS)
+            return uint64_t(i);
+        int bits = i / TRACE_SUB_BUCKETS + TRACE_SUB_SHIFT - 1;
+        uint64_t sub = i % TRACE_SUB_BUCKETS;
+        return ((uint64_t(TRACE_SUB_BUCKETS + sub + 1)) << (bits - TRACE_SUB_SHIFT)) - 1;
+    }
+};
+
+/**
+* Trace
+* opt-in instrumentation of main loop and Table, whoever holds a nullptr Trace* records nothing
+* (a branch per command, no clock read), so it costs nearly nothing when disabled.
+* - add, remove, query: latency of command by type (ns); A, D only queue, their work is in sync
+* - sync: builder applying pending A, D and publishing a version (ns), versions per second of uptime
+*       builds: full rebuilds (new byte class), reclaims: rebuilds after mass remove
+* - bytes, visited: query bytes scanned, states walked for them (prefilter skips are not walked,
+*       MEMMEM, RABIN_KARP engines walk none), matches: matched patterns per query
+*/
+struct Trace {
+    Histogram add, remove, query, sync, matches;
+    std::atomic<uint64_t> updates{0}, builds{0}, reclaims{0};
+    std::atomic<uint64_t> bytes{0}, visited{0};
+    const uint64_t start = now();
+
+    // monotonic clock in nanoseconds
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // command by type ('Q', 'A', 'D') which began at `begin` is done
+    void command(char cmd, uint64_t begin) {
+        uint64_t elapsed = now() - begin;
+        switch (cmd) {
+        case 'Q':
+            query.record(elapsed);
+            break;
+        case 'A':
+            add.record(elapsed);
+            break;
+        case 'D':
+            remove.record(elapsed);
+            break;
+        }
+    }
+
+    void scanned(size_t size, size_t states) {
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        visited.fetch_add(states, std::memory_order_relaxed);
+    }
+
+    // summary, safe while others record
+    void dump(FILE* out) const {
+        double uptime = (now() - start) / 1e9;
+        fprintf(out, "trace: uptime %.3f s\n", uptime);
+        latency(out, "Q", query);
+        latency(out, "A", add);
+        latency(out, "D", remove);
+        latency(out, "sync", sync);
+        fprintf(out, "  versions: %llu (%.2f/s), updates %llu, builds %llu, reclaims %llu\n",
+            (unsigned long long)sync.count(), sync.count() / std::max(uptime, 1e-9),
+            (unsigned long long)updates.load(), (unsigned long long)builds.load(), (unsigned long long)reclaims.load());
+        uint64_t scanned = bytes.load();
+        fprintf(out, "  scan: bytes %llu, states %llu, states/byte %.3f\n",
+            (unsigned long long)scanned, (unsigned long long)visited.load(), scanned ? double(visited.load()) / scanned : 0.0);
+        fprintf(out, "  matches/query: mean %.2f, p50 %llu, p99 %llu, max %llu\n", matches.mean(),
+            (unsigned long long)matches.percentile(0.5), (unsigned long long)matches.percentile(0.99),
+            (unsigned long long)matches.max());
+        fflush(out);
+    }
+
+private:
+    static void latency(FILE* out, const char* name, const Histogram& histogram) {
+        fprintf(out, "  %s: count %llu, mean %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n", name,
+            (unsigned long long)histogram.count(), histogram.mean() / 1e3, histogram.percentile(0.5) / 1e3,
+            histogram.percentile(0.99) / 1e3, histogram.percentile(0.999) / 1e3, histogram.max() / 1e3);
+    }
+};
+
+#endif
@@ -1,11 +1,17 @@
 #include <set>
 #include <list>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 #ifndef UNIQUE_VECTOR_H
 #define UNIQUE_VECTOR_H
 
 #define UNIQUE_VECTOR_DEFAULT_SIZE 4096
+// slots of hash index, power of two, kept at most half full
+#define UNIQUE_INDEX_DEFAULT_SIZE 1024
 
 namespace unique {
 
@@ -225,5 +231,223 @@ namespace unique {
             return true;
         }
     };
+
+    /**
+    * string_vector
+    * unique::vector of strings, without inspector set and linear find
+    * - arena: bytes of every string stored once, back to back (entry has offset, length)
+    * - index: open addressing (linear probing) hash index of entry, erase shifts back instead of tombstone
+    * - erase is O(1): erased entry is swapped with last one, so order is not kept
+    * - arena is compacted when more than half of it is erased bytes
+    */
+    class string_vector {
+    public:
+        string_vector() : index(UNIQUE_INDEX_DEFAULT_SIZE, EMPTY) {
+            entries.reserve(UNIQUE_VECTOR_DEFAULT_SIZE);
+        }
+        template<typename Iterable>
+        string_vector(const Iterable& container) : string_vector() {
+            for (const auto& item : container) {
+                insert(item);
+            }
+        }
+        template<typename Iter>
+        string_vector(Iter begin, Iter end) : string_vector() {
+            for (Iter it = begin; it != end; ++it) {
+                insert(*it);
+            }
+        }
+        ~string_vector() {}
+
+        void reserve(size_t size) {
+            entries.reserve(size);
+            if (size * 2 > index.size())
+                rehash(size * 2);
+        }
+
+        bool insert(const std::string& element) {
+            return insert(element.data(), element.length());
+        }
+
+        bool insert(const char* data, size_t length) {
+            uint64_t code = hash(data, length);
+            size_t slot = probe(data, length, code);
+            if (index[slot] != EMPTY)
+                return false;
+
+            if ((entries.size() + 1) * 2 > index.size()) {
+                rehash(index.size() * 2);
+                slot = probe(data, length, code);
+            }
+            index[slot] = entries.size();
+            entries.push_back(Entry{arena.size(), length, code});
+            arena.insert(arena.end(), data, data + length);
+            t_size += length;
+            return true;
+        }
+
+        bool erase(int position) {
+            if (position < 0 || size_t(position) >= entries.size())
+                return false;
+            const Entry& entry = entries[position];
+            remove(slot_of(position, entry.hash));
+            return true;
+        }
+
+        bool erase(const std::string& element) {
+            size_t slot = probe(element.data(), element.length(), hash(element.data(), element.length()));
+            if (index[slot] == EMPTY)
+                return false;
+            remove(slot);
+            return true;
+        }
+
+        std::string operator[] (int position) const {
+            return at(position);
+        }
+
+        std::string at(int position) const {
+            return std::string(data(position), length(position));
+        }
+
+        // bytes of element in arena, valid until next insert or erase
+        const char* data(int position) const {
+            return arena.data() + entries[position].offset;
+        }
+
+        size_t length(int position) const {
+            return entries[position].length;
+        }
+
+        // position of element, -1 if not exists
+        int find(const std::string& element) const {
+            return index[probe(element.data(), element.length(), hash(element.data(), element.length()))];
+        }
+
+        bool contains(const std::string& element) const {
+            return find(element) != EMPTY;
+        }
+
+        void clear() {
+            arena.clear();
+            entries.clear();
+            std::fill(index.begin(), index.end(), EMPTY);
+            garbage = t_size = 0;
+        }
+
+        size_t size() const {
+            return entries.size();
+        }
+
+        size_t rsize() const {
+            return t_size;
+        }
+
+        // bytes held by arena, entries and index
+        size_t memory() const {
+            return arena.capacity() + entries.capacity() * sizeof(Entry) + index.capacity() * sizeof(int);
+        }
+
+    private:
+        enum { EMPTY = -1 };
+
+        struct Entry {
+            size_t offset;
+            size_t length;
+            uint64_t hash;
+        };
+
+        std::vector<char> arena;
+        std::vector<Entry> entries;
+        std::vector<int> index;
+        size_t garbage = 0;
+        size_t t_size = 0;
+
+        // FNV-1a
+        static uint64_t hash(const char* data, size_t length) {
+            uint64_t code = 14695981039346656037ULL;
+            for (size_t i = 0; i < length; i++) {
+                code ^= (unsigned char)data[i];
+                code *= 1099511628211ULL;
+            }
+            return code;
+        }
+
+        // slot of element, or empty slot where it would be inserted
+        size_t probe(const char* data, size_t length, uint64_t code) const {
+            size_t mask = index.size() - 1;
+            for (size_t slot = code & mask; ; slot = (slot + 1) & mask) {
+                int position = index[slot];
+                if (position == EMPTY)
+                    return slot;
+                const Entry& entry = entries[position];
+                if (entry.hash == code && entry.length == length
+                    && std::memcmp(arena.data() + entry.offset, data, length) == 0)
+                    return slot;
+            }
+        }
+
+        size_t slot_of(int position, uint64_t code) const {
+            size_t mask = index.size() - 1;
+            size_t slot = code & mask;
+            while (index[slot] != position)
+                slot = (slot + 1) & mask;
+            return slot;
+        }
+
+        // erase entry of slot: shift back following cluster, then move last entry into its place
+        void remove(size_t slot) {
+            int position = index[slot];
+            size_t mask = index.size() - 1;
+            size_t hole = slot;
+            for (size_t next = (hole + 1) & mask; index[next] != EMPTY; next = (next + 1) & mask) {
+                size_t home = entries[index[next]].hash & mask;
+                if (((next - home) & mask) >= ((next - hole) & mask)) {
+                    index[hole] = index[next];
+                    hole = next;
+                }
+            }
+            index[hole] = EMPTY;
+
+            t_size -= entries[position].length;
+            garbage += entries[position].length;
+
+            int last = entries.size() - 1;
+            if (position != last) {
+                index[slot_of(last, entries[last].hash)] = position;
+                entries[position] = entries[last];
+            }
+            entries.pop_back();
+
+            if (garbage > UNIQUE_VECTOR_DEFAULT_SIZE && garbage * 2 > arena.size())
+                compact();
+        }
+
+        void rehash(size_t size) {
+            size_t slots = UNIQUE_INDEX_DEFAULT_SIZE;
+            while (slots < size)
+                slots <<= 1;
+            index.assign(slots, EMPTY);
+            size_t mask = slots - 1;
+            for (size_t position = 0; position < entries.size(); position++) {
+                size_t slot = entries[position].hash & mask;
+                while (index[slot] != EMPTY)
+                    slot = (slot + 1) & mask;
+                index[slot] = position;
+            }
+        }
+
+        void compact() {
+            std::vector<char> next;
+            next.reserve(t_size * 2);
+            for (auto& entry : entries) {
+                size_t offset = next.size();
+                next.insert(next.end(), arena.begin() + entry.offset, arena.begin() + entry.offset + entry.length);
+                entry.offset = offset;
+            }
+            arena.swap(next);
+            garbage = 0;
+        }
+    };
 }
 #endif
@@ -1,66 +1,467 @@
-#include <iostream>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+
 #include <string>
 #include <set>
 #include <vector>
-#include <iostream>
 #include <algorithm>
 #include <iterator>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
 
 // define newl, cuz std::endl is too much slow for buffer flush
 #define newl ('\n')
 #define sep ('|')
 #include <ahocorasick.h>
+#include <argparser.h>
+#include <pool.h>
+#include <stream.h>
 
 using namespace std;
 
+// most queries in a batch, a batch is every query already arrived in input buffer
+#define BATCH_SIZE (1 << 14)
+// query length to split into chunks in batch mode
+#define DEFAULT_CHUNK_SIZE (1 << 16)
+// poll interval of --follow until publisher has shared a map
+#define FOLLOW_WAIT_MS (10)
+
+// --engine values, indexed by Automaton::Engine
+static const char* ENGINE_NAMES[] = {"auto", "automaton", "memmem", "rabin-karp"};
+
+/**
+* write matched patterns of a query as one line
+* @param: out; string&, line is appended
+* @param: automaton; const Automaton&, version matches are found in
+* @param: hits; const vector<Automaton::Hit>&, pattern ids in order to print (Matches::hits or cached)
+*/
+void format(string& out, const Automaton& automaton, const vector<Automaton::Hit>& hits) {
+    if (hits.empty()) {
+        out += "-1";
+    } else {
+        Automaton::Pattern pattern = automaton.pattern(hits[0].second);
+        out.append(pattern.data, pattern.length);
+        for (size_t i = 1; i < hits.size(); i++) {
+            pattern = automaton.pattern(hits[i].second);
+            out += sep;
+            out.append(pattern.data, pattern.length);
+        }
+    }
+    out += newl;
+}
+
+/**
+* Scratch
+* buffers of batch mode, kept across batches so matching allocates nothing in steady state
+* - results: output line of each query
+* - matches: result buffer of each task (range of short queries, or chunk of long query)
+* - merged: merged result buffer of each long query
+* - keys, hits: Cache::hash() of each query, cached result of a hit
+* - same, seen: index of first equal query in batch (itself if none), first query of each key
+*       repeats: queries answered by an equal one of same batch (not counted by Cache::Stats)
+*/
+struct Scratch {
+    vector<string> results;
+    vector<Automaton::Matches> matches;
+    vector<Automaton::Matches> merged;
+    vector<size_t> shorts, longs, first;
+    vector<uint64_t> keys;
+    vector<Automaton::Hit> hits;
+    vector<size_t> same;
+    std::unordered_map<uint64_t, size_t> seen;
+    size_t repeats = 0;
+};
+
+/**
+* match batch of queries concurrently, print results in input order
+* @param: pool; Thread::Pool*, workers
+* @param: table; Table*, its snapshot is searched by every worker
+* @param: batch; vector<io::Slice>&, consecutive queries (no A, D between them), cleared after
+* @param: scratch; Scratch&, reused buffers
+* @param: chunk; size_t, queries at least this long are split into chunks (0 to never split)
+* @param: writer; io::Writer&, results are appended
+* @param: trace; Trace*, latency of each query from start of flush, states walked, matches; nullptr for none
+* - queries cached on this version (Table::cache()) are formatted at once, others are matched and cached
+*       repeats of a query in batch take result of its first one
+* - split short queries into contiguous ranges, a few per worker to balance long and short queries
+* - split each long query into one chunk per worker, chunks overlap by Automaton::max_length() - 1
+*       so a match is found by the chunk where it starts, Automaton::merge() keeps first occurrence.
+*/
+void flush(Thread::Pool* pool, Table* table, vector<io::Slice>& batch, Scratch& scratch, size_t chunk, io::Writer& writer,
+           Trace* trace) {
+    if (batch.empty())
+        return;
+    uint64_t start = trace ? Trace::now() : 0;
+
+    std::shared_ptr<const Automaton> snapshot = table->snapshot();
+    const Automaton* automaton = snapshot.get();
+    Cache* cache = table->cache();
+
+    vector<size_t>& shorts = scratch.shorts;
+    vector<size_t>& longs = scratch.longs;
+    vector<size_t>& first = scratch.first;
+    shorts.clear();
+    longs.clear();
+    first.clear();
+    scratch.results.resize(batch.size());
+    scratch.keys.resize(cache ? batch.size() : 0);
+    scratch.same.resize(cache ? batch.size() : 0);
+    scratch.seen.clear();
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (cache) {
+            scratch.keys[i] = Cache::hash(batch[i].data, batch[i].size);
+            scratch.same[i] = i;
+            auto found = scratch.seen.emplace(scratch.keys[i], i);
+            const io::Slice& prior = batch[found.first->second];
+            if (!found.second && prior.size == batch[i].size && memcmp(prior.data, batch[i].data, prior.size) == 0) {
+                scratch.same[i] = found.first->second;
+                ++scratch.repeats;
+                if (trace)
+                    trace->command('Q', start);
+                continue;
+            }
+            if (cache->get(automaton->version, scratch.keys[i], batch[i].data, batch[i].size, scratch.hits)) {
+                scratch.results[i].clear();
+                format(scratch.results[i], *automaton, scratch.hits);
+                if (trace) {
+                    trace->command('Q', start);
+                    trace->matches.record(scratch.hits.size());
+                }
+                continue;
+            }
+        }
+        if (chunk && batch[i].size >= chunk)
+            longs.push_back(i);
+        else
+            shorts.push_back(i);
+    }
+
+    // chunk is kept longer than overlap, or most of the work is scanned twice
+    size_t tasks = std::min(shorts.size(), pool->size() * 4);
+    size_t total = tasks;
+    size_t overlap = std::max<size_t>(automaton->max_length(), 1);
+    for (size_t i = 0; i < longs.size(); i++) {
+        first.push_back(total);
+        total += std::max<size_t>(std::min(pool->size(), batch[longs[i]].size / (overlap * 4)), 1);
+    }
+    first.push_back(total);
+
+    if (scratch.matches.size() < total)
+        scratch.matches.resize(total);
+    if (scratch.merged.size() < longs.size())
+        scratch.merged.resize(longs.size());
+
+    vector<future<void>> futures;
+    futures.reserve(total);
+
+    for (size_t task = 0; task < tasks; task++) {
+        size_t begin = shorts.size() * task / tasks;
+        size_t end = shorts.size() * (task + 1) / tasks;
+        futures.push_back(pool->push([&batch, &scratch, automaton, cache, trace, start, task, begin, end]() {
+            Automaton::Matches& matches = scratch.matches[task];
+            for (size_t i = begin; i < end; i++) {
+                const io::Slice& query = batch[scratch.shorts[i]];
+                string& result = scratch.results[scratch.shorts[i]];
+                automaton->scan(query.data, query.size, 0, query.size, matches);
+                if (cache)
+                    cache->put(automaton->version, scratch.keys[scratch.shorts[i]], query.data, query.size, matches.hits);
+                result.clear();
+                format(result, *automaton, matches.hits);
+                if (trace) {
+                    trace->command('Q', start);
+                    trace->scanned(query.size, matches.visited);
+                    trace->matches.record(matches.hits.size());
+                }
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < longs.size(); i++) {
+        io::Slice query = batch[longs[i]];
+        size_t chunks = first[i + 1] - first[i];
+        for (size_t part = 0; part < chunks; part++) {
+            size_t begin = query.size * part / chunks;
+            size_t end = query.size * (part + 1) / chunks;
+            Automaton::Matches* matches = &scratch.matches[first[i] + part];
+            futures.push_back(pool->push([query, automaton, matches, begin, end]() {
+                automaton->scan(query.data, query.size, begin, end, *matches);
+            }));
+        }
+    }
+
+    for (auto& future : futures)
+        future.get();
+
+    for (size_t i = 0; i < longs.size(); i++) {
+        string& result = scratch.results[longs[i]];
+        automaton->merge(&scratch.matches[first[i]], first[i + 1] - first[i], scratch.merged[i]);
+        if (cache)
+            cache->put(automaton->version, scratch.keys[longs[i]], batch[longs[i]].data, batch[longs[i]].size, scratch.merged[i].hits);
+        result.clear();
+        format(result, *automaton, scratch.merged[i].hits);
+        if (trace) {
+            trace->command('Q', start);
+            trace->scanned(batch[longs[i]].size, scratch.merged[i].visited);
+            trace->matches.record(scratch.merged[i].hits.size());
+        }
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        writer.buffer() += scratch.results[cache ? scratch.same[i] : i];
+        writer.spill();
+    }
+    batch.clear();
+}
+
+// FNV-1a of initial patterns (each with its separator), image of another pattern set is rebuilt
+uint64_t digest(const vector<string>& patterns) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const auto& pattern : patterns) {
+        for (unsigned char ch : pattern)
+            hash = (hash ^ ch) * 1099511628211ULL;
+        hash = (hash ^ newl) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// hit rate and memory of query result cache to stderr, nothing if there is none
+// repeats: queries of batch mode answered by an equal query of same batch
+void report(Table* table, size_t repeats = 0) {
+    Cache* cache = table->cache();
+    if (!cache)
+        return;
+    Cache::Stats stats = cache->stats();
+    fprintf(stderr, "cache: hits: %zu, repeats: %zu, misses: %zu, hit rate: %.1f%%, entries: %zu, bytes: %zu, evictions: %zu, expired: %zu\n",
+        stats.hits, repeats, stats.misses, double(stats.hits + repeats) * 100 / std::max<size_t>(stats.hits + repeats + stats.misses, 1),
+        stats.entries, stats.bytes, stats.evictions, stats.expired);
+}
+
 int main(int argc, char * argv[]) {
-    int n = 0;
     char cmd;
-    string query;
-    set<string> patterns;
+    string token;
+    io::Slice query;
+    vector<string> patterns;
+
+    arg::Parser parser;
+    parser.argument("threads", "worker threads to build map and match batch of queries, 1 to match inline");
+    parser.argument("chunk", "query length to split into chunks matched concurrently, 0 to never split");
+    parser.argument("layout", "map layout, dense (fastest) or sparse (compact)");
+    parser.argument("memory", "1 to print memory per state of map to stderr after build");
+    parser.argument("hugepages", "1 to back map of each full build with huge pages");
+    parser.argument("engine", "matcher, auto (chosen per version), automaton, memmem or rabin-karp");
+    parser.argument("cache", "MiB of query result cache, repeated query on same pattern set is not matched again, 0 for none");
+    parser.argument("image", "compiled map file, mapped instead of building if it has same patterns, saved otherwise");
+    parser.argument("shared", "shared memory map name, every version is published there for --follow processes");
+    parser.argument("follow", "shared memory map name, match on map another process publishes instead of building, A, D are ignored");
+    parser.argument("trace", "1 to record latency per command, sync and scan counters, dumped to stderr at exit and on SIGUSR1");
+    if (!parser.parse(argc, argv)) {
+        fprintf(stderr, "%s", parser.usage().c_str());
+        return 1;
+    }
+
+    size_t threads = parser.get<size_t>("threads", 1);
+    size_t chunk = parser.get<size_t>("chunk", DEFAULT_CHUNK_SIZE);
+    string layout_name = parser.get<string>("layout", "dense");
+    if (layout_name != "dense" && layout_name != "sparse") {
+        fprintf(stderr, "unknown layout: %s\n%s", layout_name.c_str(), parser.usage().c_str());
+        return 1;
+    }
+    Automaton::Layout layout = layout_name == "sparse" ? Automaton::SPARSE : Automaton::DENSE;
+    string image = parser.get<string>("image", "");
+    bool hugepages = parser.get<int>("hugepages", 0) != 0;
+    string engine_name = parser.get<string>("engine", "auto");
+    int engine = -1;
+    for (int e = Automaton::AUTO; e <= Automaton::RABIN_KARP; e++) {
+        if (engine_name == ENGINE_NAMES[e])
+            engine = e;
+    }
+    if (engine < 0) {
+        fprintf(stderr, "unknown engine: %s\n%s", engine_name.c_str(), parser.usage().c_str());
+        return 1;
+    }
+    size_t cache = parser.get<size_t>("cache", 0);
+    string shared = parser.get<string>("shared", "");
+    string follow = parser.get<string>("follow", "");
+
+    // SIGUSR1 is blocked before any thread starts, so only signal thread takes it and dumps trace
+    // trace lives until exit, signal thread may dump it any time
+    Trace* trace = nullptr;
+    if (parser.get<int>("trace", 0)) {
+        trace = new Trace;
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        std::thread([trace, signals]() {
+            int signal;
+            while (sigwait(&signals, &signal) == 0)
+                trace->dump(stderr);
+        }).detach();
+    }
+
+    // read stdin in blocks (or mmap), commands are parsed in place
+    // write output in blocks, but flush before waiting for input since peer waits for results
+    io::Reader reader(STDIN_FILENO);
+    io::Writer writer(STDOUT_FILENO);
+
+    int n = reader.token(token) ? std::stoi(token) : 0;
+    patterns.reserve(n);
+    for (int i = 0; i < n && reader.token(token); i++) {
+        patterns.push_back(token);
+    }
+    Table::Options options;
+    options.layout = layout;
+    options.hugepages = hugepages;
+    options.threads = threads;
+    options.cache = cache << 20;
+    options.trace = trace;
+    options.shared = shared;
+    options.engine = Automaton::Engine(engine);
+    Table* table = nullptr;
+    if (!follow.empty()) {
+        // initial patterns are publisher's, map is not built here
+        for (bool waiting = false; !(table = Table::follow(follow, options)); waiting = true) {
+            if (!waiting)
+                fprintf(stderr, "waiting for shared map: %s\n", follow.c_str());
+            std::this_thread::sleep_for(std::chrono::milliseconds(FOLLOW_WAIT_MS));
+        }
+    }
+    if (!table && !image.empty())
+        table = Table::open(image, digest(patterns), options);
+    if (!table) {
+        table = new Table(patterns, options);
+        if (!image.empty() && !table->save(image, digest(patterns)))
+            fprintf(stderr, "failed to save image: %s\n", image.c_str());
+    }
+    if (!shared.empty() && table->published_elsewhere())
+        fprintf(stderr, "failed to share map: %s is held by another publisher, use --follow=%s to match on it\n",
+            shared.c_str(), shared.c_str());
+    else if (!shared.empty() && !table->sharing())
+        fprintf(stderr, "failed to share map: %s\n", shared.c_str());
+    vector<string>().swap(patterns);
+    if (parser.get<int>("memory", 0)) {
+        std::shared_ptr<const Automaton> automaton = table->snapshot();
+        fprintf(stderr, "layout: %s, engine: %s, states: %zu, bytes: %zu, bytes/state: %.1f\n",
+            layout == Automaton::SPARSE ? "sparse" : "dense", ENGINE_NAMES[automaton->engine], automaton->states, automaton->memory(),
+            double(automaton->memory()) / std::max<size_t>(automaton->states, 1));
+    }
+    writer.buffer() += "R";
+    writer.buffer() += newl;
+    writer.flush();
+
+    if (threads > 1) {
+        // batch mode, gather queries until A, D or input runs out (next read may block)
+        Thread::Pool pool(threads);
+        vector<io::Slice> batch;
+        Scratch scratch;
+
+        for (;;) {
+            if (!reader.command(cmd, query)) {
+                // slices in batch are invalid after fill
+                flush(&pool, table, batch, scratch, chunk, writer, trace);
+                writer.flush();
+                if (!reader.fill())
+                    break;
+                continue;
+            }
+
+            if (cmd == 'Q') {
+                batch.push_back(query);
+                if (batch.size() >= BATCH_SIZE)
+                    flush(&pool, table, batch, scratch, chunk, writer, trace);
+                continue;
+            }
 
-    // make stream io faster, (but do not use mixed `iostream` with `stdio.h`)
-    std::ios_base::sync_with_stdio(false);
-    std::cin >> n;
-    for (int i = 0; i < n; i++) {
-        std::cin >> query;
-        patterns.insert(query);
+            flush(&pool, table, batch, scratch, chunk, writer, trace);
+            uint64_t begin = trace ? Trace::now() : 0;
+            switch (cmd) {
+            case 'A':
+                table->add(string(query.data, query.size));
+                break;
+            case 'D':
+                table->remove(string(query.data, query.size));
+                break;
+            }
+            if (trace)
+                trace->command(cmd, begin);
+        }
+        writer.flush();
+        report(table, scratch.repeats);
+        if (trace)
+            trace->dump(stderr);
+        delete table;
+        return 0;
     }
-    Table* table = new Table(patterns);
-    std::cout << "R" << newl;
 
-    while (std::cin >> cmd) {
-        std::cin.get();
-        getline(std::cin, query);
+    Automaton::Matches matches;
+    for (;;) {
+        if (!reader.command(cmd, query)) {
+            writer.flush();
+            // query over half of input buffer is matched as it arrives, not reassembled
+            if (reader.split('Q', query)) {
+                uint64_t begin = trace ? Trace::now() : 0;
+                Automaton::Stream stream = table->stream();
+                stream.feed(query.data, query.size);
+                bool done = false;
+                while (!done && reader.fill()) {
+                    done = reader.rest(query);
+                    stream.feed(query.data, query.size);
+                }
+                const Automaton::Matches& found = stream.finish();
+                format(writer.buffer(), stream.version(), found.hits);
+                writer.spill();
+                if (trace) {
+                    trace->command('Q', begin);
+                    trace->matches.record(found.hits.size());
+                }
+                continue;
+            }
+            if (!reader.fill())
+                break;
+            continue;
+        }
 
+        uint64_t begin = trace ? Trace::now() : 0;
         switch (cmd) {
         case 'Q': {
-            // Table::match return list of matched patterns
-            list<string> matches = table->match(query);
-
-            // so, just print return of Table::match
-            auto begin = matches.begin();
-            if (begin != matches.end()) {
-                std::cout << *(begin++);
-                while (begin != matches.end()) {
-                    std::cout << sep;
-                    std::cout << *(begin++);
-                }
-            } else {
-                std::cout << -1;
+            // match against latest version, matches holds pattern ids in order to print
+            std::shared_ptr<const Automaton> automaton = table->snapshot();
+            Cache* results = table->cache();
+            uint64_t key = results ? Cache::hash(query.data, query.size) : 0;
+            if (!results || !results->get(automaton->version, key, query.data, query.size, matches.hits)) {
+                automaton->scan(query.data, query.size, 0, query.size, matches);
+                if (results)
+                    results->put(automaton->version, key, query.data, query.size, matches.hits);
+                if (trace)
+                    trace->scanned(query.size, matches.visited);
             }
-            std::cout << newl;
+            format(writer.buffer(), *automaton, matches.hits);
+            writer.spill();
+            if (trace)
+                trace->matches.record(matches.hits.size());
         }
-                  break;
+            break;
         case 'A':
-            // Table::add do not process immediately, it will processed if necessary(Table::match called)
-            table->add(query);
+            // Table::add do not process immediately, builder thread publishes it as next version
+            table->add(string(query.data, query.size));
             break;
         case 'D':
-            // Table::remove do not process immediately, it will processed if necessary(Table::match called)
-            table->remove(query);
+            // Table::remove do not process immediately, builder thread publishes it as next version
+            table->remove(string(query.data, query.size));
             break;
         }
+        if (trace)
+            trace->command(cmd, begin);
     }
+    writer.flush();
+    report(table);
+    if (trace)
+        trace->dump(stderr);
+    delete table;
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,211 @@
+// locate() and occurrence counts against scan() on test/data fixtures, run from project1
+// every path that reports a match is compared: map walk (dense, sparse), MEMMEM, RABIN_KARP lookup,
+// ranges of a query merged (batch chunks) and Stream fed in fragments
+#define CATCH_CONFIG_MAIN
+// SIGSTKSZ is not a constant since glibc 2.34, catch 1.10 sizes its signal stack with it
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
+#include "../catch.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+#include <ahocorasick.h>
+
+namespace {
+
+struct Fixture {
+    std::vector<std::string> patterns;
+    // (command, argument) of each work line, command is 'Q', 'A' or 'D'
+    std::vector<std::pair<char, std::string>> work;
+};
+
+Fixture load(const std::string& name) {
+    Fixture fixture;
+    std::ifstream init("test/data/" + name + ".init");
+    std::string line;
+    std::getline(init, line);
+    while (std::getline(init, line))
+        fixture.patterns.push_back(line);
+
+    std::ifstream work("test/data/" + name + ".work");
+    while (std::getline(work, line)) {
+        if (line.size() >= 2)
+            fixture.work.emplace_back(line[0], line.substr(2));
+    }
+    return fixture;
+}
+
+// start of every (overlapping) occurrence of pattern in query
+std::vector<size_t> occurrences(const std::string& query, const std::string& pattern) {
+    std::vector<size_t> starts;
+    for (size_t at = query.find(pattern); at != std::string::npos; at = query.find(pattern, at + 1))
+        starts.push_back(at);
+    return starts;
+}
+
+// "id@offset*count" of each match, so a mismatch prints the whole result
+std::vector<std::string> format(const std::vector<Automaton::Match>& result) {
+    std::vector<std::string> lines;
+    for (const auto& match : result)
+        lines.push_back(std::to_string(match.id) + "@" + std::to_string(match.offset) + "*" + std::to_string(match.count));
+    return lines;
+}
+
+std::vector<std::string> format(const Automaton::Matches& matches) {
+    std::vector<Automaton::Match> result;
+    for (const auto& hit : matches.hits)
+        result.push_back(Automaton::Match{hit.second, hit.first, matches.counting ? matches.counts[hit.second] : 0});
+    return format(result);
+}
+
+// occurrences cut by a boundary, a split walk or stream must carry them over
+struct Crossings {
+    size_t chunk = 0;
+    size_t stream = 0;
+};
+
+// occurrences with a cut (ascending positions) inside
+size_t crossing(const std::vector<std::vector<size_t>>& starts, const std::vector<size_t>& lengths, const std::vector<size_t>& cuts) {
+    size_t count = 0;
+    for (size_t i = 0; i < starts.size(); i++) {
+        for (size_t start : starts[i]) {
+            auto cut = std::upper_bound(cuts.begin(), cuts.end(), start);
+            count += cut != cuts.end() && *cut < start + lengths[i];
+        }
+    }
+    return count;
+}
+
+void check(const std::shared_ptr<const Automaton>& automaton, const std::string& query, Crossings& crossings) {
+    Automaton::Matches whole;
+    automaton->scan(query, 0, query.length(), whole);
+
+    std::vector<Automaton::Match> plain = automaton->locate(query);
+    std::vector<Automaton::Match> counted = automaton->locate(query, true);
+    REQUIRE(plain.size() == whole.hits.size());
+    REQUIRE(counted.size() == whole.hits.size());
+    std::vector<std::vector<size_t>> starts;
+    std::vector<size_t> lengths;
+    for (size_t i = 0; i < whole.hits.size(); i++) {
+        std::string pattern = automaton->pattern(counted[i].id).str();
+        starts.push_back(occurrences(query, pattern));
+        lengths.push_back(pattern.length());
+        REQUIRE(plain[i].id == whole.hits[i].second);
+        REQUIRE(plain[i].offset == whole.hits[i].first);
+        REQUIRE(plain[i].count == 0);
+        REQUIRE(counted[i].id == whole.hits[i].second);
+        REQUIRE(counted[i].offset == starts[i].front());
+        REQUIRE(counted[i].count == starts[i].size());
+    }
+    std::vector<std::string> expected = format(counted);
+
+    // ranges own disjoint starts, their counts sum to the whole query's
+    std::vector<size_t> sizes = {1, 7, 64};
+    if (query.length() > 1024)
+        sizes = {4096, query.length() / 3 + 1};
+    for (size_t size : sizes) {
+        std::vector<Automaton::Matches> parts((query.length() + size - 1) / size);
+        std::vector<size_t> cuts;
+        for (size_t part = 0; part < parts.size(); part++) {
+            parts[part].counting = true;
+            automaton->scan(query, part * size, std::min(query.length(), (part + 1) * size), parts[part]);
+            cuts.push_back((part + 1) * size);
+        }
+        Automaton::Matches merged;
+        merged.counting = true;
+        automaton->merge(parts.data(), parts.size(), merged);
+        REQUIRE(format(merged) == expected);
+        crossings.chunk += crossing(starts, lengths, cuts);
+    }
+
+    // fragments of varying size, walk state carries over each cut
+    const size_t fragments[] = {1, 5, 2, 64, 3};
+    Automaton::Stream stream(automaton, true);
+    std::vector<size_t> cuts;
+    for (size_t i = 0, fed = 0; fed < query.length(); i++) {
+        size_t size = std::min(fragments[i % 5], query.length() - fed);
+        stream.feed(query.data() + fed, size);
+        fed += size;
+        cuts.push_back(fed);
+    }
+    REQUIRE(stream.position() == query.length());
+    REQUIRE(format(stream.finish()) == expected);
+    crossings.stream += crossing(starts, lengths, cuts);
+}
+
+// replay fixture on a table, check every query against the version it's answered by
+void replay(const std::string& name, const Table::Options& options) {
+    Fixture fixture = load(name);
+    REQUIRE(!fixture.patterns.empty());
+    Table table(fixture.patterns, options);
+
+    Crossings crossings;
+    size_t queries = 0;
+    for (const auto& command : fixture.work) {
+        if (command.first == 'A') {
+            table.add(command.second);
+        } else if (command.first == 'D') {
+            table.remove(command.second);
+        } else if (command.first == 'Q') {
+            std::vector<Automaton::Match> result;
+            std::shared_ptr<const Automaton> automaton = table.locate(command.second, result, true);
+            REQUIRE(format(result) == format(automaton->locate(command.second, true)));
+
+            std::list<std::string> matched = table.match(command.second);
+            REQUIRE(matched.size() == result.size());
+            auto pattern = matched.begin();
+            for (const auto& match : result)
+                REQUIRE(*pattern++ == automaton->pattern(match.id).str());
+
+            check(automaton, command.second, crossings);
+            queries++;
+        }
+    }
+    REQUIRE(queries > 0);
+    // fixtures are long enough to cut through some match, or the split paths are not exercised
+    REQUIRE(crossings.chunk > 0);
+    REQUIRE(crossings.stream > 0);
+}
+
+Table::Options with(Automaton::Layout layout, Automaton::Engine engine) {
+    Table::Options options;
+    options.layout = layout;
+    options.engine = engine;
+    return options;
+}
+
+const char* FIXTURES[] = {"tiny", "bytes", "repeat", "long", "churn"};
+// engines search query once per pattern, churn (17000 patterns) alone takes a minute with memmem
+const char* ENGINE_FIXTURES[] = {"tiny", "repeat", "long"};
+
+}
+
+TEST_CASE("locate and counts match scan, dense map", "[locate]") {
+    for (const char* name : FIXTURES) {
+        INFO("fixture " << name);
+        replay(name, with(Automaton::DENSE, Automaton::AUTOMATON));
+    }
+}
+
+TEST_CASE("locate and counts match scan, sparse map", "[locate]") {
+    for (const char* name : FIXTURES) {
+        INFO("fixture " << name);
+        replay(name, with(Automaton::SPARSE, Automaton::AUTOMATON));
+    }
+}
+
+TEST_CASE("locate and counts match scan, memmem engine", "[locate][engine]") {
+    for (const char* name : ENGINE_FIXTURES) {
+        INFO("fixture " << name);
+        replay(name, with(Automaton::DENSE, Automaton::MEMMEM));
+    }
+}
+
+TEST_CASE("locate and counts match scan, rabin-karp engine", "[locate][engine]") {
+    for (const char* name : ENGINE_FIXTURES) {
+        INFO("fixture " << name);
+        replay(name, with(Automaton::DENSE, Automaton::RABIN_KARP));
+    }
+}
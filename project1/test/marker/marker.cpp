@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <math.h>
 
 #include <string>
 #include <vector>
@@ -11,15 +13,104 @@
 #include <fstream>
 #include <sstream>
 
-//const unsigned BATCH_SIZE = 1000;
+// Workload lines per batch, 0 sends the whole workload as one batch
+const unsigned long DEFAULT_BATCH_SIZE = 0;
+// Batches sent before the results of the oldest one are complete
+const unsigned long DEFAULT_PIPELINE_DEPTH = 1;
 const unsigned long MAX_FAILED_QUERIES = 100;
 
 // Print the usage instructions for the harness
 void usage()
 {
-	std::cerr << "Usage: marker <init-file> <workload-file> <result-file> <test-executable>" << std::endl;
+	std::cerr << "Usage: marker <init-file> <workload-file> <result-file> <test-executable> [batch-size] [pipeline-depth]" << std::endl;
 }
 
+// Monotonic time in nanoseconds
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear latency histogram (HDR style): each power of two is split into 2^SUB_BITS buckets,
+// so every recorded value keeps 5 bits below its leading bit (within 1/32, about 3%, of its value).
+class Histogram
+{
+public:
+	static const int SUB_BITS = 5;
+	static const int SUB_COUNT = 1 << SUB_BITS;
+
+	Histogram() : counts(64 * SUB_COUNT, 0), total(0), sum(0), min(~0ULL), max(0) {}
+
+	void record(unsigned long long value)
+	{
+		++counts[index(value)];
+		++total;
+		sum += value;
+		if (value < min)
+			min = value;
+		if (value > max)
+			max = value;
+	}
+
+	// Smallest bucket upper bound below which the given fraction of values lie
+	unsigned long long percentile(double fraction) const
+	{
+		unsigned long long rank = (unsigned long long) ceil(fraction * total);
+		if (rank == 0)
+			rank = 1;
+		unsigned long long seen = 0;
+		for (size_t i = 0; i != counts.size(); ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+				return std::min(upper(i), max);
+		}
+		return max;
+	}
+
+	// Print the percentile table in microseconds
+	void print(const char *name) const
+	{
+		static const double fractions[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999, 1.0 };
+
+		std::cout << name << ": count " << total;
+		if (total == 0)
+		{
+			std::cout << std::endl;
+			return;
+		}
+		std::cout << ", min " << min / 1000.0 << " us, mean " << sum / 1000.0 / total << " us, max " << max / 1000.0 << " us" << std::endl;
+		for (size_t i = 0; i != sizeof(fractions) / sizeof(fractions[0]); ++i)
+			std::cout << "  p" << fractions[i] * 100 << "\t" << percentile(fractions[i]) / 1000.0 << " us" << std::endl;
+	}
+
+private:
+	std::vector<unsigned long long> counts;
+	unsigned long long total;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+
+	static size_t index(unsigned long long value)
+	{
+		if (value < (unsigned long long) SUB_COUNT)
+			return value;
+		int exponent = 63 - __builtin_clzll(value) - SUB_BITS;
+		return (exponent + 1) * SUB_COUNT + ((value >> exponent) - SUB_COUNT);
+	}
+
+	static unsigned long long upper(size_t index)
+	{
+		if (index < (size_t) SUB_COUNT)
+			return index;
+		int exponent = index / SUB_COUNT - 1;
+		unsigned long long sub = index % SUB_COUNT + SUB_COUNT;
+		return ((sub + 1) << exponent) - 1;
+	}
+};
+
 // Set a file descriptor to be non-blocking
 int set_nonblocking(int fd)
 {
@@ -72,14 +163,21 @@ ssize_t write_bytes(int fd, const void *buffer, size_t num_bytes)
 int main(int argc, char *argv[])
 {
 	// Check for the correct number of arguments
-	if (argc != 5)
+	if (argc < 5 || argc > 7)
 	{
 		usage();
 		exit(EXIT_FAILURE);
 	}
 
+	unsigned long batch_size = argc > 5 ? strtoul(argv[5], NULL, 10) : DEFAULT_BATCH_SIZE;
+	unsigned long depth = argc > 6 ? strtoul(argv[6], NULL, 10) : DEFAULT_PIPELINE_DEPTH;
+	if (depth == 0)
+		depth = 1;
+
 	std::vector<std::string> input_batches;
 	std::vector<std::vector<std::string> > result_batches;
+	// End offset of each query line in its batch, the query is sent once the input passes it
+	std::vector<std::vector<size_t> > query_ends;
 
 	// Load the workload and result files and parse them into batches
 	{
@@ -104,10 +202,10 @@ int main(int argc, char *argv[])
 			input_chunk.reserve(1000000);
 
 			std::vector<std::string> result_chunk;
-			//result_chunk.reserve(BATCH_SIZE);
+			std::vector<size_t> end_chunk;
 
 			std::string line;
-			while(1)//for (unsigned long line_no = 0; line_no != BATCH_SIZE; ++line_no)
+			for (unsigned long line_no = 0; batch_size == 0 || line_no != batch_size; ++line_no)
 			{
 				eof = !std::getline(work_file, line);
 				if (eof)
@@ -122,6 +220,7 @@ int main(int argc, char *argv[])
 					std::getline(result_file,result);
 
 					result_chunk.push_back(result);
+					end_chunk.push_back(input_chunk.length());
 				}
 			}
 
@@ -129,6 +228,7 @@ int main(int argc, char *argv[])
 			{
 				input_batches.push_back(input_chunk); // copy to avoid accumulation of unused space in each chunk
 				result_batches.push_back(result_chunk); // copy may be avoided in C++ 11 with std::move
+				query_ends.push_back(end_chunk);
 			}
 		}
 	}
@@ -232,102 +332,142 @@ int main(int argc, char *argv[])
 	unsigned long query_no = 0;
 	unsigned long failure_cnt = 0;
 
-	// Loop over all batches
-	for (unsigned long batch = 0; batch != input_batches.size() && failure_cnt < MAX_FAILED_QUERIES; ++batch)
-	{
-		std::string output; // raw output is collected here
-		output.reserve(1000000);
-
-		size_t input_ofs = 0; // byte position in the input batch
-		size_t output_read = 0; // number of lines read from the child output
+	// Queries are numbered across batches, query_base[batch] is the first one of the batch
+	size_t batch_count = input_batches.size();
+	std::vector<size_t> query_base(batch_count + 1, 0);
+	for (size_t batch = 0; batch != batch_count; ++batch)
+		query_base[batch + 1] = query_base[batch] + result_batches[batch].size();
 
-		while (input_ofs != input_batches[batch].length() || output_read != result_batches[batch].size())
-		{
-			fd_set read_fd, write_fd;
-			FD_ZERO(&read_fd);
-			FD_ZERO(&write_fd);
+	// Batches in [read_batch, write_batch] are in flight, at most `depth` of them.
+	// A batch is complete once it is fully written and all its results are read.
+	size_t write_batch = 0, write_ofs = 0, sent = 0;
+	size_t read_batch = 0, received = 0;
+	std::string output; // raw output not compared yet is collected here
+	output.reserve(1000000);
 
-			if (input_ofs != input_batches[batch].length())
-				FD_SET(stdin_pipe[1], &write_fd);
+	std::vector<unsigned long long> batch_start(batch_count, 0);
+	std::vector<unsigned long long> sent_time(query_base[batch_count], 0);
+	Histogram batch_latency, query_latency;
 
-			if (output_read != result_batches[batch].size())
-				FD_SET(stdout_pipe[0], &read_fd);
-
-			int retval = select(std::max(stdin_pipe[1], stdout_pipe[0]) + 1, &read_fd, &write_fd, NULL, NULL);
-			if (retval == -1)
-			{
-				perror("select");
-				exit(EXIT_FAILURE);
-			}
+	while (read_batch != batch_count && failure_cnt < MAX_FAILED_QUERIES)
+	{
+		// Complete the oldest batch, compare its result
+		if (read_batch < write_batch && received >= query_base[read_batch + 1])
+		{
+			if (!result_batches[read_batch].empty())
+				batch_latency.record(now_ns() - batch_start[read_batch]);
 
-			// Read output from the test program
-			if (FD_ISSET(stdout_pipe[0], &read_fd))
+			size_t ofs = 0;
+			for (unsigned i = 0; i != result_batches[read_batch].size() && failure_cnt < MAX_FAILED_QUERIES; ++i)
 			{
-				char buffer[4096];
-				int bytes = read(stdout_pipe[0], buffer, sizeof(buffer));
-				if (bytes < 0)
+				size_t newline = output.find('\n', ofs);
+				if (newline == std::string::npos)
 				{
-					if (errno == EINTR)
-						continue;
-					perror("read");
-					exit(1);
+					std::cerr << "Incomplete batch output for batch " << read_batch << std::endl;
+					exit(EXIT_FAILURE);
 				}
-				// Count how many lines were returned
-				for (size_t j = 0; j != size_t(bytes); ++j)
+				std::string val = output.substr(ofs, newline - ofs);
+				ofs = newline + 1;
+
+				bool matched = val == result_batches[read_batch][i];
+				if (!matched)
 				{
-					if (buffer[j] == '\n')
-						++output_read;
+					std::cerr << "Result mismatch for query " << query_no << ", expected: " << result_batches[read_batch][i] << ", actual: " << val << std::endl;
+					++failure_cnt;
 				}
-				output.append(buffer, bytes);
+				++query_no;
 			}
+			// Output of later batches may already be read
+			output.erase(0, ofs);
+			++read_batch;
+			continue;
+		}
+
+		fd_set read_fd, write_fd;
+		FD_ZERO(&read_fd);
+		FD_ZERO(&write_fd);
+
+		bool writing = write_batch != batch_count && write_batch < read_batch + depth;
+		if (writing)
+			FD_SET(stdin_pipe[1], &write_fd);
+
+		if (received < sent)
+			FD_SET(stdout_pipe[0], &read_fd);
+
+		int retval = select(std::max(stdin_pipe[1], stdout_pipe[0]) + 1, &read_fd, &write_fd, NULL, NULL);
+		if (retval == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("select");
+			exit(EXIT_FAILURE);
+		}
 
-			// Feed another chunk of data from this batch to the test program
-			if (FD_ISSET(stdin_pipe[1], &write_fd))
+		// Read output from the test program
+		if (FD_ISSET(stdout_pipe[0], &read_fd))
+		{
+			char buffer[4096];
+			int bytes = read(stdout_pipe[0], buffer, sizeof(buffer));
+			if (bytes < 0)
 			{
-				int bytes = write(stdin_pipe[1], input_batches[batch].data() + input_ofs, input_batches[batch].length() - input_ofs);
-				if (bytes < 0)
-				{
-					if (errno == EINTR)
-						continue;
-					perror("write");
-					exit(EXIT_FAILURE);
-				}
-				input_ofs += bytes;
+				if (errno == EINTR)
+					continue;
+				perror("read");
+				exit(1);
 			}
+			if (bytes == 0)
+			{
+				std::cerr << "Test program closed its output" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			// Count how many lines were returned, each answers the oldest query sent
+			unsigned long long now = now_ns();
+			for (size_t j = 0; j != size_t(bytes); ++j)
+			{
+				if (buffer[j] == '\n' && received < sent)
+					query_latency.record(now - sent_time[received++]);
+			}
+			output.append(buffer, bytes);
 		}
 
-		// Parse and compare the batch result
-		std::stringstream result(output);
-                
-		for (unsigned i = 0; i != result_batches[batch].size() && failure_cnt < MAX_FAILED_QUERIES; ++i)
+		// Feed another chunk of data of the newest batch to the test program
+		if (writing && FD_ISSET(stdin_pipe[1], &write_fd))
 		{
-			std::string val;
-                        
-			//result >> val;
-                        std::getline(result,val);
-			if (!result)
+			const std::string &input = input_batches[write_batch];
+			if (write_ofs == 0)
+				batch_start[write_batch] = now_ns();
+
+			int bytes = write(stdin_pipe[1], input.data() + write_ofs, input.length() - write_ofs);
+			if (bytes < 0)
 			{
-				std::cerr << "Incomplete batch output for batch " << batch << std::endl;
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				perror("write");
 				exit(EXIT_FAILURE);
 			}
+			write_ofs += bytes;
+
+			// A query is sent once its whole line is written
+			unsigned long long now = now_ns();
+			const std::vector<size_t> &ends = query_ends[write_batch];
+			while (sent != query_base[write_batch + 1] && ends[sent - query_base[write_batch]] <= write_ofs)
+				sent_time[sent++] = now;
 
-			bool matched = val == result_batches[batch][i];
-			if (!matched)
+			if (write_ofs == input.length())
 			{
-				std::cerr << "Result mismatch for query " << query_no << ", expected: " << result_batches[batch][i] << ", actual: " << val << std::endl;
-				++failure_cnt;
+				++write_batch;
+				write_ofs = 0;
 			}
-                        /*if (matched)
-                        {
-                            std::cout << std::endl << val << std::endl <<  std::endl << result_batches[batch][i];
-                        }*/
-			++query_no;
 		}
 	}
 
 	struct timeval end;
 	gettimeofday(&end, NULL);
 
+	std::cout << "Batch size: " << batch_size << ", pipeline depth: " << depth << ", batches: " << batch_count << std::endl;
+	batch_latency.print("Batch latency");
+	query_latency.print("Query latency");
+
 	if (failure_cnt == 0)
 	{
 		// Output the elapsed time in milliseconds